@@ -4,6 +4,7 @@
 
 import ctypes
 import argparse
+import csv
 import os
 import sys
 from contextlib import contextmanager
@@ -20,9 +21,12 @@ try:
     def getdt(sec, nsec):
         return datetime64(datetime.utcfromtimestamp(sec), 'ns') + timedelta64(nsec, 'ns')
     def getdelta(mdelta):
-        return timedelta64(mdelta, 'ms')
+        # mdelta is in microseconds
+        return timedelta64(int(round(mdelta * 1000)), 'ns')
     def isodt(dt):
         return str(dt)
+    def dt_to_ns(dt):
+        return int(dt.astype('datetime64[ns]').astype('int64'))
 except ImportError:
     def getdt(sec, nsec):
         return datetime.utcfromtimestamp(sec + nsec / 1000000000.)
@@ -30,6 +34,9 @@ except ImportError:
         return timedelta(microseconds=mdelta)
     def isodt(dt):
         return dt.isoformat()
+    def dt_to_ns(dt):
+        delta = dt - datetime(1970, 1, 1)
+        return (delta.days * 86400 + delta.seconds) * 1000000000 + delta.microseconds * 1000
 
 DEBUG_LEVEL = 0
 
@@ -45,12 +52,52 @@ MONITORED_OUTPUTS = {
     'VALI': 'Chunk #4',
     'VALJ': 'Chunk #5',
     'VALK': 'Chunk #6',
+    'VALN': 'Overhead (hundredths of percent)',
+    'VALO': 'Mode',
+    'VALP': 'List of activations',
     'VALR': 'List of IDs',
     'VALS': 'List of names',
     'VALT': 'Ticks at the time of timestamp',
     'VALU': 'Record size (in uint32_t)',
     }
 
+ISR_MONITORED_OUTPUTS = {
+    'VALA': 'Number of accounted handlers',
+    'VALB': 'List of vectors',
+    'VALC': 'Hits per handler',
+    'VALD': 'Busy time per handler (us)',
+    'VALE': 'Worst service time per handler (us)',
+    'VALF': 'Timestamp: Seconds',
+    'VALG': 'Timestamp: Nanoseconds',
+    'VALH': 'Ticks at the time of timestamp',
+    'VALI': 'Number of events',
+    'VALJ': 'Index of first event',
+    'VALK': 'ISR events',
+    'VALL': 'Ticks per second',
+    'VALU': 'Record size (in uint32_t)',
+    }
+
+MODE_NAMES = {
+    0: 'disabled',
+    1: 'aggregated counters',
+    2: 'raw tracing',
+}
+MODE_AGGREGATE = 1
+
+EV_SWITCH    = 0
+EV_BEGIN     = 1
+EV_EXIT      = 2
+EV_ISR_ENTER = 3
+EV_ISR_EXIT  = 4
+
+EV_NAMES = {
+    EV_SWITCH:    'SWITCH',
+    EV_BEGIN:     'BEGIN',
+    EV_EXIT:      'EXIT',
+    EV_ISR_ENTER: 'ISR_ENTER',
+    EV_ISR_EXIT:  'ISR_EXIT',
+}
+
 CHUNKSUFFS = "FGHIJK"
 CHUNKS = set('VAL{0}'.format(x) for x in CHUNKSUFFS)
 
@@ -69,6 +116,7 @@ def colorize(text, color):
     return "\x1b[{0}m{1}\x1b[0m".format(COLORS[color], text)
 
 MAX_EVENTS = 4096
+MAX_ISR_EVENTS = 512
 
 # NOTE: This list is valid for RTEMS 4.10. It may change across versions
 # There's also STATES_READY = 0x0000, but we treat that one in a special way
@@ -135,18 +183,88 @@ class RtemsStatsEventTimestamp(ctypes.Structure, RtemsStatsEvent):
 
 
 class EventPrinter(object):
-    def __init__(self, args, stamp_translator):
+    """
+    Task and ISR events come from different records, so they're queued and
+    printed in timestamp order. When ISR events are monitored, printing lags
+    one export behind, to give the ISR record a chance to catch up with the
+    task one.
+    """
+    def __init__(self, args, stamp_translator, isr_stamp_translator):
         self.prev_id = None
         self.args = args
         self.stampt = stamp_translator
+        self.isr_stampt = isr_stamp_translator
+        self.thread_map = {}
+        self.isr_counters = {}
+        self.mode = None
+        self.pending = []
+        self.seq = 0
+        self.watermark = None
+
+    def set_mode(self, mode, overhead):
+        if mode != self.mode:
+            self.print_mode(mode, overhead)
+        self.mode = mode
 
     def set_trate(self, ticks_per_second):
         self.stampt.set_trate(ticks_per_second)
+        self.isr_stampt.set_trate(ticks_per_second)
 
     def set_timestamp(self, *args):
         self.stampt.set_timestamp(*args)
 
+    def _queue(self, tstamp, event, is_isr):
+        # The sequence number keeps the original order for events sharing a stamp
+        self.pending.append((tstamp, self.seq, is_isr, event))
+        self.seq += 1
+
     def print_ev(self, event, t_mapping):
+        self._queue(self.stampt.get_timestamp(event), event, False)
+
+    def print_isr_ev(self, event):
+        self._queue(self.isr_stampt.get_timestamp(event), event, True)
+
+    def end_of_window(self):
+        "Called after queuing the events from a task export"
+        if not self.args.isr:
+            self.flush()
+            return
+
+        task_stamps = [tstamp for (tstamp, seq, is_isr, event) in self.pending if not is_isr]
+        if self.watermark is not None:
+            self.flush(self.watermark)
+        if task_stamps:
+            self.watermark = max(task_stamps)
+
+    def flush(self, upto=None):
+        self.pending.sort(key=lambda item: (item[0], item[1]))
+        if upto is None:
+            ready, self.pending = self.pending, []
+        else:
+            ready = [item for item in self.pending if item[0] <= upto]
+            self.pending = [item for item in self.pending if item[0] > upto]
+        for (tstamp, seq, is_isr, event) in ready:
+            if is_isr:
+                self.write_isr_ev(tstamp, event)
+            else:
+                self.write_ev(tstamp, event)
+
+    def write_ev(self, tstamp, event):
+        raise NotImplementedError("Please use a derivative class that implements this method...")
+
+    def write_isr_ev(self, tstamp, event):
+        raise NotImplementedError("Please use a derivative class that implements this method...")
+
+    def print_mode(self, mode, overhead):
+        raise NotImplementedError("Please use a derivative class that implements this method...")
+
+    def print_activations(self, activations, t_mapping):
+        raise NotImplementedError("Please use a derivative class that implements this method...")
+
+    def print_isr_counters(self, counters):
+        raise NotImplementedError("Please use a derivative class that implements this method...")
+
+    def print_isr_overflow(self, lost):
         raise NotImplementedError("Please use a derivative class that implements this method...")
 
 
@@ -157,6 +275,8 @@ class ConsoleEventPrinter(EventPrinter):
     def __init__(self, *args, **kw):
         super(ConsoleEventPrinter, self).__init__(*args, **kw)
         self.is_terminal = os.isatty(sys.stdout.fileno())
+        # ISR time (ns) spent on top of each task since it got the CPU
+        self.isr_time = defaultdict(int)
 
     def get_prio(self, prio):
         if self.args.rtems_prio:
@@ -169,30 +289,122 @@ class ConsoleEventPrinter(EventPrinter):
         ret = '*{0:03d}'.format(prio)
         return ret if not self.is_terminal else colorize(ret, 'yellow')
 
-    def print_ev(self, event, t_mapping):
+    def write_ev(self, tstamp, event):
         if self.prev_id is None:
             self.prev_id = event.obj_id
             return
 
-        tstamp = self.stampt.get_timestamp(event)
-
         st = event.status_text()
         state = st if event.wait_id == 0 else "{0}, {1:#08x}".format(st, event.wait_id)
         prio_current, prio_real = self.get_prio(event.prio_current), self.get_prio(event.prio_real)
-        print "{stamp}: {name_a:20s} -> {name_b:20s} {pcur}/{preal} ({state})".format(
+        isr_ns = self.isr_time.pop(self.prev_id, 0)
+        print "{stamp}: {name_a:20s} -> {name_b:20s} {pcur}/{preal} ({state}){isr}".format(
                 id_a  = self.prev_id,
                 id_b  = event.obj_id,
-                name_a = t_mapping.get(self.prev_id, 'UNKNOWN'),
-                name_b = t_mapping.get(event.obj_id, 'UNKNOWN'),
+                name_a = self.thread_map.get(self.prev_id, 'UNKNOWN'),
+                name_b = self.thread_map.get(event.obj_id, 'UNKNOWN'),
                 stamp = isodt(tstamp),
                 state = state,
                 pcur  = (" ---" if prio_current == prio_real else prio_current),
-                preal = prio_real
+                preal = prio_real,
+                isr   = (" [ISR {0} us]".format(isr_ns // 1000) if isr_ns > 0 else "")
                 )
         self.prev_id = event.obj_id
 
+    def print_mode(self, mode, overhead):
+        print "# rtemsStats mode: {mode} (overhead {overhead:.2f}%)".format(
+                mode = MODE_NAMES.get(mode, 'unknown'),
+                overhead = overhead)
+
+    def print_activations(self, activations, t_mapping):
+        for (tid, count) in activations:
+            print "{name:20s} {count:6d} activations".format(name = t_mapping.get(tid, 'UNKNOWN'), count = count)
+
+    def write_isr_ev(self, tstamp, event):
+        name = self.thread_map.get(event.wait_id, "{0:#08x}".format(event.wait_id))
+        if event.ev_type == EV_ISR_ENTER:
+            print "{stamp}: ISR {vector:#06x} interrupts {name}".format(
+                    stamp = isodt(tstamp),
+                    vector = event.obj_id,
+                    name = name)
+        else:
+            # For ISR_EXIT, 'state' holds the time spent in the handler (ns)
+            self.isr_time[event.wait_id] += event.state
+            print "{stamp}: ISR {vector:#06x} done after {us} us, charged to {name}".format(
+                    stamp = isodt(tstamp),
+                    vector = event.obj_id,
+                    us = event.state // 1000,
+                    name = name)
+
+    def print_isr_counters(self, counters):
+        for (vector, hits, busy, worst) in counters:
+            prev_hits, prev_busy = self.isr_counters.get(vector, (0, 0))
+            if hits != prev_hits:
+                print "ISR {vector:#06x}: {hits} hits, {busy} us busy (worst {worst} us)".format(
+                        vector = vector,
+                        hits = hits - prev_hits,
+                        busy = busy - prev_busy,
+                        worst = worst)
+            self.isr_counters[vector] = (hits, busy)
+
+    def print_isr_overflow(self, lost):
+        ret = "# ISR buffer overflowed: {0} events lost".format(lost)
+        print ret if not self.is_terminal else colorize(ret, 'bright_red')
+
+# This is also the format understood by tracestats.py. Priorities are always
+# the RTEMS ones, and ISR events carry the vector in the 'to' columns and the
+# interrupted task in the 'from' ones. duration_ns is only set for ISR_EXIT
+CSV_COLUMNS = ['timestamp', 'stamp_ns', 'event', 'from_id', 'from_name', 'to_id', 'to_name',
+               'prio_current', 'prio_real', 'state', 'wait_id', 'duration_ns']
+
 class CsvEventPrinter(EventPrinter):
-    pass
+    def __init__(self, *args, **kw):
+        super(CsvEventPrinter, self).__init__(*args, **kw)
+        self.writer = csv.writer(sys.stdout)
+        self.writer.writerow(CSV_COLUMNS)
+
+    def _write(self, tstamp, event, from_id, to_id, state, duration=''):
+        self.writer.writerow([
+            isodt(tstamp),
+            dt_to_ns(tstamp),
+            EV_NAMES.get(event.ev_type, 'UNKNOWN'),
+            '{0:#x}'.format(from_id) if from_id is not None else '',
+            self.thread_map.get(from_id, '{0:#x}'.format(from_id)) if from_id is not None else '',
+            '{0:#x}'.format(to_id),
+            self.thread_map.get(to_id, '{0:#x}'.format(to_id)),
+            event.prio_current,
+            event.prio_real,
+            state,
+            '{0:#x}'.format(event.wait_id),
+            duration,
+            ])
+        sys.stdout.flush()
+
+    def write_ev(self, tstamp, event):
+        if event.ev_type == EV_SWITCH:
+            if self.prev_id is not None:
+                self._write(tstamp, event, self.prev_id, event.obj_id, event.status_text())
+            self.prev_id = event.obj_id
+        else:
+            self._write(tstamp, event, None, event.obj_id, event.status_text())
+
+    def write_isr_ev(self, tstamp, event):
+        if event.ev_type == EV_ISR_EXIT:
+            self._write(tstamp, event, event.wait_id, event.obj_id, '', event.state)
+        else:
+            self._write(tstamp, event, event.wait_id, event.obj_id, '')
+
+    def print_mode(self, mode, overhead):
+        pass
+
+    def print_activations(self, activations, t_mapping):
+        pass
+
+    def print_isr_counters(self, counters):
+        pass
+
+    def print_isr_overflow(self, lost):
+        print >>sys.stderr, "ISR buffer overflowed: {0} events lost".format(lost)
 
 class TimestampTranslator(object):
     def set_trate(self, *args):
@@ -241,14 +453,16 @@ def printerFactory(args, info):
     stamp_translator_class = TimestampTranslator if (info & 0x01) else TicksTranslator
 
     try:
-        return format_dict[args.fmt](args, stamp_translator_class())
+        return format_dict[args.fmt](args, stamp_translator_class(), stamp_translator_class())
     except KeyError:
-        raise ValueError("Unknown format: {0}".format(args.gmt))
+        raise ValueError("Unknown format: {0}".format(args.fmt))
 
 class Buffer(object):
+    outputs = MONITORED_OUTPUTS
+
     def __init__(self, event_class):
         self.seq_no = None
-        self.attributes = dict((x, None) for x in MONITORED_OUTPUTS)
+        self.attributes = dict((x, None) for x in self.outputs)
         self._set_attributes = set()
         self.invalid = False
         self.evCls = event_class
@@ -259,7 +473,7 @@ class Buffer(object):
         self._set_attributes.add(output)
 
     def done(self):
-        return self._set_attributes == set(MONITORED_OUTPUTS)
+        return self._set_attributes == set(self.outputs)
 
     @property
     def timestamp(self):
@@ -282,11 +496,25 @@ class Buffer(object):
     def longs_per_entry(self):
         return self.attributes['VALU']
 
+    @property
+    def overhead(self):
+        return self.attributes['VALN'] / 100.0
+
+    @property
+    def mode(self):
+        return self.attributes['VALO']
+
     def dump(self, printer):
         events = self.number_of_events
         copyevents = self.number_of_events
         thread_map = dict((i, n if n != 'UNKNOWN' else "{0:#08x}".format(i)) for (i, n) in zip(self.attributes['VALR'], self.attributes['VALS']))
         thread_map[0x9010001] = 'IDLE'
+        printer.thread_map = thread_map
+        printer.set_mode(self.mode, self.overhead)
+        if DEBUG_LEVEL > 0:
+            print "# overhead: {0:.2f}%".format(self.overhead)
+        if self.mode == MODE_AGGREGATE:
+            printer.print_activations(zip(self.attributes['VALR'], self.attributes['VALP']), thread_map)
         printer.set_trate(self.ticks_per_second)
         if events > 0:
             if DEBUG_LEVEL > 0:
@@ -305,16 +533,68 @@ class Buffer(object):
             printer.set_timestamp(self.timestamp, self.ticks_at_timestamp)
             for n in range(copyevents):
                 printer.print_ev(data[n], thread_map)
+        printer.end_of_window()
+
+class IsrBuffer(Buffer):
+    outputs = ISR_MONITORED_OUTPUTS
+
+    @property
+    def timestamp(self):
+        return getdt(self.attributes['VALF'], self.attributes['VALG'])
+
+    @property
+    def ticks_at_timestamp(self):
+        return self.attributes['VALH']
+
+    @property
+    def ticks_per_second(self):
+        return self.attributes['VALL']
+
+    @property
+    def number_of_events(self):
+        return min(self.attributes['VALI'], MAX_ISR_EVENTS)
+
+    @property
+    def lost_events(self):
+        return max(0, self.attributes['VALI'] - MAX_ISR_EVENTS)
+
+    @property
+    def first_event(self):
+        return self.attributes['VALJ'] if self.lost_events > 0 else 0
+
+    def dump(self, printer):
+        nslots = self.attributes['VALA']
+        if nslots > 0:
+            # With a single handler, NEV is 1 and the arrays arrive as scalars
+            printer.print_isr_counters(zip(*(np.atleast_1d(self.attributes[x])[:nslots]
+                                             for x in ('VALB', 'VALC', 'VALD', 'VALE'))))
+
+        if self.lost_events > 0:
+            printer.print_isr_overflow(self.lost_events)
+
+        events = self.number_of_events
+        if events > 0:
+            data = (self.evCls * events)()
+            ctypes.memmove(ctypes.byref(data), self.attributes['VALK'], events * self.longs_per_entry * 4)
+            printer.isr_stampt.set_trate(self.ticks_per_second)
+            printer.isr_stampt.set_timestamp(self.timestamp, self.ticks_at_timestamp)
+            first = self.first_event
+            for n in range(events):
+                printer.print_isr_ev(data[(first + n) % events])
 
 class SessionTracker(object):
-    def __init__(self, pvprefix):
+    def __init__(self, pvprefix, isr=False):
         self.buffers = None
+        self.isr_buffers = None
         self.printer = None
         self.prefix = pvprefix
         self.control = "{0}:control".format(pvprefix)
         self.main    = PV("{0}:export".format(pvprefix))
         self.outputs = [PV('{0}:export.{1}'.format(pvprefix, var), auto_monitor=epics.dbr.DBE_VALUE, callback=self.callback)
                         for var in MONITORED_OUTPUTS]
+        if isr:
+            self.isr_outputs = [PV('{0}:isr.{1}'.format(pvprefix, var), auto_monitor=epics.dbr.DBE_VALUE, callback=self.isr_callback)
+                                for var in ISR_MONITORED_OUTPUTS]
 
     def _get_pv_var(self, var_name):
         return epics.PV("{0}.{1}".format(self.control, var_name))
@@ -344,8 +624,18 @@ class SessionTracker(object):
             print "Setting {0} as invalid".format(timestamp)
             buff.invalid = True
 
+    def isr_callback(self, pvname, value, count, status, timestamp, **kw):
+        if status != 0 or self.isr_buffers is None or self.printer is None:
+            return
+        buff = self.isr_buffers[timestamp]
+        buff.set_data(pvname, value)
+        if buff.done():
+            buff.dump(self.printer)
+            del self.isr_buffers[timestamp]
+
     def set_buffer_class(self, cls):
         self.buffers = defaultdict(partial(Buffer, cls))
+        self.isr_buffers = defaultdict(partial(IsrBuffer, cls))
 
     def enable(self, en):
         if DEBUG_LEVEL > 0:
@@ -356,7 +646,7 @@ class SessionTracker(object):
 def monitor_session(args, monitored):
     if DEBUG_LEVEL > 0:
         print "Creating the SessionTracker for PV: {0}".format(monitored)
-    mon = SessionTracker(monitored)
+    mon = SessionTracker(monitored, isr=args.isr)
     info = mon.get_info()
     mon.set_buffer_class(RtemsStatsEventTimestamp if (info & 0x01) else RtemsStatsEventTicks)
     mon.printer = printerFactory(args, info)
@@ -372,6 +662,7 @@ def monitor_session(args, monitored):
         yield mon
     finally:
         mon.enable(False)
+        mon.printer.flush()
 
 def main(args):
     try:
@@ -388,6 +679,8 @@ def parse_args():
                         help='More verbose output')
     parser.add_argument('-r', dest='rtems_prio', action='store_true',
                         help='Display RTEMS priorities (default is to show EPICS ones). Does not affect all output types')
+    parser.add_argument('-i', dest='isr', action='store_true',
+                        help='Display interrupt activity (requires the IOC to be built with WITH_ISR_STATS)')
     parser.add_argument('--format', dest='fmt', default='console', choices=['console', 'csv'],
                         help='Output format')
     parser.add_argument('top', help='Top of the database, as in {top}:rtems:stats')
@@ -0,0 +1,243 @@
+#!/usr/bin/env python
+
+# vim: ai:sw=4:sts=4:expandtab
+
+"""
+Generates the synthetic reference traces in this directory.
+
+The traces come from a small simulation of a fixed-priority preemptive
+scheduler running a typical IOC task set, plus a periodic interrupt, and are
+written in the same CSV format produced by monitor.py --format csv. They're
+meant to exercise tracestats.py with known regressions, not to stand for any
+real IOC: add captures from your own IOCs next to them (and to CHECKS) as a
+baseline for your upgrades.
+
+Run it from this directory to regenerate the corpus:
+
+    $ python generate.py
+"""
+
+from __future__ import print_function, division
+
+import csv
+import gzip
+import io
+import random
+import sys
+from datetime import datetime, timedelta
+
+STEP_US = 10
+DURATION_US = 30000000
+START = datetime(2018, 6, 8, 23, 22, 51)
+START_NS = 1528500171 * 1000000000
+
+IDLE = (0x9010001, 'IDLE', 255)
+COLUMNS = ['timestamp', 'stamp_ns', 'event', 'from_id', 'from_name', 'to_id', 'to_name',
+           'prio_current', 'prio_real', 'state', 'wait_id', 'duration_ns']
+
+# A board interrupt (eg. the network controller). Service times are in ns
+ISR_VECTOR = 0x44
+ISR_PERIOD_US = 5000
+ISR_SERVICE_NS = (20000, 50000)
+
+class Task(object):
+    def __init__(self, tid, name, prio, period_us, exec_us, wait_state, mutex_prob=0.0,
+                 start_us=0, end_us=None):
+        self.tid = tid
+        self.name = name
+        self.prio = prio                # RTEMS priority: lower is more important
+        self.boosted = None
+        self.period_us = period_us
+        self.exec_us = exec_us
+        self.wait_state = wait_state
+        self.mutex_prob = mutex_prob
+        self.jitter = (0.8, 1.2)        # Range of run times, as a fraction of exec_us
+        self.burst_prob = 0.0           # Chance of an activation taking burst_factor times longer
+        self.burst_factor = 1
+        self.start_us = start_us        # Tasks created and deleted during the capture
+        self.end_us = end_us
+        self.started = False
+        self.exited = False
+        self.next_release = 0
+        self.remaining = 0
+        self.blocked = False
+        self.lock_at = None
+
+    @property
+    def current_prio(self):
+        return self.boosted if self.boosted is not None else self.prio
+
+    @property
+    def ready(self):
+        return self.remaining > 0 and not self.blocked
+
+    def alive(self, t):
+        return t >= self.start_us and (self.end_us is None or t < self.end_us)
+
+def task_set(variant):
+    # (EPICS priority -> RTEMS priority is 199 - prio)
+    tasks = [
+        Task(0xa010004, 'timerQueue', 129, 1700,   60,   'WAITING FOR EVENT'),
+        Task(0xa010008, 'scan0.01',   131, 10000,  2000, 'WAITING FOR SEMAPHORE', mutex_prob=0.15),
+        Task(0xa010009, 'scan0.1',    133, 100000, 4000, 'WAITING FOR SEMAPHORE'),
+        Task(0xa01000c, 'cbLow',      140, 20000,  900,  'WAITING FOR EVENT'),
+        Task(0xa010014, 'CAS-event',  178, 20000,  150,  'WAITING FOR EVENT',
+             start_us=1000000, end_us=DURATION_US - 1000000),
+        Task(0xa010010, 'CAS-client', 179, 5000,   300,  'WAITING FOR EVENT'),
+        Task(0xa010012, 'errlog',     189, 50000,  200,  'WAITING FOR EVENT'),
+    ]
+    isr_scale = 1
+    byname = dict((t.name, t) for t in tasks)
+    # The number of expired timers varies a lot from one run to the next
+    byname['timerQueue'].jitter = (0.5, 1.8)
+    if variant == 'slow-timer':
+        # A driver upgrade makes the timer queue callbacks more expensive,
+        # which delays the scan tasks every time they're preempted
+        byname['timerQueue'].exec_us = 240
+    elif variant == 'timer-bursts':
+        # Same, but only once in a while: the typical latencies stay where
+        # they were, only the tail moves
+        byname['timerQueue'].burst_prob = 0.02
+        byname['timerQueue'].burst_factor = 8
+    elif variant == 'contention':
+        # scan0.01 fights for the lock held by cbLow much more often
+        byname['scan0.01'].mutex_prob = 0.6
+    elif variant == 'slow-isr':
+        # The interrupt handler got three times slower
+        isr_scale = 3
+    elif variant == 'hung-scan':
+        # scan0.1 got stuck before the capture started, and never runs
+        tasks.remove(byname['scan0.1'])
+    return tasks, byname['cbLow'], isr_scale
+
+def simulate(variant, seed):
+    rnd = random.Random(seed)
+    tasks, lock_owner, isr_scale = task_set(variant)
+    for task in tasks:
+        task.next_release = task.start_us + rnd.randint(0, task.period_us // STEP_US) * STEP_US
+    next_isr = rnd.randint(0, ISR_PERIOD_US // STEP_US) * STEP_US
+    isr_debt = 0                        # Time stolen from the running task by interrupts, in ns
+
+    waiting_on_lock = None
+    running = None
+    events = []
+
+    def ids(task):
+        return (IDLE[0], IDLE[1]) if task is None else (task.tid, task.name)
+
+    def emit(t, prev, heir, state, wait_id):
+        heir_id, heir_name = ids(heir)
+        heir_cur, heir_real = (IDLE[2], IDLE[2]) if heir is None else (heir.current_prio, heir.prio)
+        prev_id, prev_name = ids(prev)
+        events.append((t * 1000, 'SWITCH', prev_id, prev_name, heir_id, heir_name, heir_cur, heir_real,
+                       state, wait_id, ''))
+
+    def emit_task(t, event, task):
+        events.append((t * 1000, event, None, '', task.tid, task.name, task.current_prio, task.prio,
+                       'READY', 0, ''))
+
+    for t in range(0, DURATION_US, STEP_US):
+        for task in tasks:
+            if task.start_us > 0 and task.alive(t) and not task.started:
+                task.started = True
+                emit_task(t, 'BEGIN', task)
+            if task.end_us is not None and t >= task.end_us and not task.exited and task.remaining == 0:
+                task.exited = True
+                emit_task(t, 'EXIT', task)
+            if t >= task.next_release and task.alive(t):
+                jitter = rnd.uniform(*task.jitter)
+                if rnd.random() < task.burst_prob:
+                    jitter *= task.burst_factor
+                task.remaining += int(task.exec_us * jitter) // STEP_US * STEP_US or STEP_US
+                # Releases wander around, as they do on a real IOC. Otherwise the
+                # initial phases would decide which tasks ever collide
+                drift = task.period_us // 20 // STEP_US
+                task.next_release += task.period_us + rnd.randint(-drift, drift) * STEP_US
+                # Halfway through its work, the task will find the lock taken
+                if rnd.random() < task.mutex_prob:
+                    task.lock_at = task.remaining // 2
+
+        ready = [task for task in tasks if task.ready]
+        heir = min(ready, key=lambda task: task.current_prio) if ready else None
+
+        if heir is not running:
+            if running is None:
+                state, wait_id = 'READY', 0
+            elif running.blocked:
+                state, wait_id = 'WAITING FOR MUTEX', 0x1a013981
+            elif running.remaining > 0:
+                state, wait_id = 'READY', 0
+            else:
+                state, wait_id = running.wait_state, 0x1a010000 + (running.tid & 0xff)
+            emit(t, running, heir, state, wait_id)
+            running = heir
+
+        if t >= next_isr:
+            enter = t * 1000 + rnd.randint(1, STEP_US * 1000 - 1)
+            service = int(rnd.uniform(*ISR_SERVICE_NS) * isr_scale)
+            victim_id, victim_name = ids(running)
+            events.append((enter, 'ISR_ENTER', victim_id, victim_name, ISR_VECTOR, '{0:#x}'.format(ISR_VECTOR),
+                           0, 0, '', victim_id, ''))
+            events.append((enter + service, 'ISR_EXIT', victim_id, victim_name, ISR_VECTOR, '{0:#x}'.format(ISR_VECTOR),
+                           0, 0, '', victim_id, service))
+            isr_debt += service
+            drift = ISR_PERIOD_US // 10 // STEP_US
+            next_isr += ISR_PERIOD_US + rnd.randint(-drift, drift) * STEP_US
+
+        if running is None:
+            isr_debt = 0
+        elif isr_debt >= STEP_US * 1000:
+            # The interrupts ate this step
+            isr_debt -= STEP_US * 1000
+        else:
+            running.remaining -= STEP_US
+            if running.lock_at is not None and running.remaining <= running.lock_at and waiting_on_lock is None \
+               and running is not lock_owner:
+                running.lock_at = None
+                running.blocked = True
+                waiting_on_lock = running
+                lock_owner.boosted = running.prio
+                lock_owner.remaining += rnd.randint(20, 60) * STEP_US
+            elif running.remaining <= 0:
+                running.remaining = 0
+                if running is lock_owner and waiting_on_lock is not None:
+                    lock_owner.boosted = None
+                    waiting_on_lock.blocked = False
+                    waiting_on_lock = None
+
+    events.sort(key=lambda ev: ev[0])
+    return events
+
+def write(path, events):
+    # mtime=0 keeps the output identical across runs
+    with gzip.GzipFile(path, 'wb', mtime=0) as raw:
+        out = raw if sys.version_info[0] == 2 else io.TextIOWrapper(raw, newline='')
+        writer = csv.writer(out)
+        writer.writerow(COLUMNS)
+        for (stamp, event, from_id, from_name, to_id, to_name, cur, real, state, wait_id, duration) in events:
+            writer.writerow([
+                (START + timedelta(microseconds=stamp // 1000)).isoformat(),
+                START_NS + stamp,
+                event,
+                '{0:#x}'.format(from_id) if from_id is not None else '', from_name,
+                '{0:#x}'.format(to_id), to_name,
+                cur, real, state, '{0:#x}'.format(wait_id),
+                duration,
+                ])
+        out.flush()
+
+CORPUS = [
+    ('baseline.csv.gz',       'baseline',     1),
+    ('baseline-rerun.csv.gz', 'baseline',     2),
+    ('slow-timer.csv.gz',     'slow-timer',   1),
+    ('timer-bursts.csv.gz',   'timer-bursts', 1),
+    ('contention.csv.gz',     'contention',   1),
+    ('slow-isr.csv.gz',       'slow-isr',     1),
+    ('hung-scan.csv.gz',      'hung-scan',    1),
+]
+
+if __name__ == '__main__':
+    for name, variant, seed in CORPUS:
+        events = simulate(variant, seed)
+        write(name, events)
+        print("{0}: {1} events".format(name, len(events)))
@@ -0,0 +1,408 @@
+#!/usr/bin/env python
+
+# vim: ai:sw=4:sts=4:expandtab
+
+"""
+Turns captured traces (the CSV output of monitor.py) into scheduling metrics,
+and compares two captures against tolerances.
+
+Unlike monitor.py, this script has no dependencies outside the standard
+library, and works with both Python 2 and 3, so that it can run on any host
+that needs to check a capture.
+"""
+
+from __future__ import print_function, division
+
+import argparse
+import csv
+import fnmatch
+import gzip
+import json
+import os
+import sys
+from collections import defaultdict
+
+IDLE_NAME = 'IDLE'
+ALL = 'ALL'
+
+# Task states that mean "waiting for someone else to release a resource".
+# Semaphores are left out on purpose: epicsEvent is built on top of them, and
+# that's what most tasks wait on when they're idle
+CONTENTION_STATES = ('WAITING FOR MUTEX', 'WAITING FOR RW LOCK')
+
+# No median, and no mean: tasks preempted by different tasks have a latency
+# made of several modes. The median jumps from one to the other between runs,
+# and the mean follows the rare, long preemptions
+PERCENTILES = (90, 99)
+
+# Percentiles out of a handful of samples are just noise. A percentile is
+# only reported if at least MIN_TAIL_SAMPLES samples are above it, too
+MIN_LATENCY_SAMPLES = 500
+MIN_TAIL_SAMPLES = 25
+
+# Tick-stamped captures (no WITH_INT_TIME) can't measure latencies. Anything
+# this coarse (in ns) is taken for one
+MAX_STAMP_RESOLUTION = 100000
+
+# Minimum absolute change for a metric to count as a regression, by suffix.
+# Keeps tiny numbers (eg. 2 -> 3 us) from tripping relative tolerances
+DEFAULT_FLOORS = {
+    '_us': 50.0,
+    '_pct': 0.5,
+    '_per_s': 1.0,
+}
+
+# These are reported, but they're not checked: either they're not "worse"
+# when they go up, or they depend on a single sample
+INFORMATIONAL = ('activations_per_s', 'latency_max_us')
+
+DEFAULT_TOLERANCE = 20.0
+
+# Default tolerance, by suffix, for the metrics that are noisier than the rest
+DEFAULT_TOLERANCES = {
+    '_us': 40.0,
+}
+
+class TraceEvent(object):
+    __slots__ = ('stamp', 'event', 'from_id', 'from_name', 'to_id', 'to_name',
+                 'prio_current', 'prio_real', 'state', 'duration')
+
+    def __init__(self, row):
+        self.stamp = int(row['stamp_ns'])
+        self.event = row['event']
+        self.from_id = row['from_id']
+        self.from_name = row['from_name'] or row['from_id']
+        self.to_id = row['to_id']
+        self.to_name = row['to_name'] or row['to_id']
+        self.prio_current = int(row['prio_current'])
+        self.prio_real = int(row['prio_real'])
+        self.state = row['state']
+        # Older captures don't have it
+        self.duration = int(row['duration_ns']) if row.get('duration_ns') else None
+
+def open_trace(path):
+    if path.endswith('.gz'):
+        return gzip.open(path, 'rt') if sys.version_info[0] > 2 else gzip.open(path, 'rb')
+    return open(path)
+
+def load_trace(path):
+    with open_trace(path) as source:
+        events = [TraceEvent(row) for row in csv.DictReader(source)]
+    # Older captures didn't merge the ISR events with the rest. The sort is
+    # stable, so events sharing a stamp keep their relative order
+    events.sort(key=lambda ev: ev.stamp)
+    return events
+
+def gcd(a, b):
+    while b:
+        a, b = b, a % b
+    return a
+
+def stamp_resolution(events):
+    "The largest step that all the stamps are a multiple of, in ns"
+    resolution = 0
+    for prev, ev in zip(events, events[1:]):
+        resolution = gcd(resolution, ev.stamp - prev.stamp)
+        if 0 < resolution < MAX_STAMP_RESOLUTION:
+            break
+    return resolution
+
+def percentile(values, pct):
+    "Nearest-rank percentile"
+    if not values:
+        return 0.0
+    ordered = sorted(values)
+    rank = max(1, int(-(-pct * len(ordered) // 100)))
+    return float(ordered[rank - 1])
+
+def compute_metrics(events):
+    """
+    Returns a dictionary of metric name -> value. Names are TASK:METRIC, with
+    ALL:METRIC for the whole trace and ISR:METRIC for interrupts.
+
+    - cpu_pct: share of the trace the task was running, ISR time excluded
+    - latency_pXX_us / latency_max_us: time from being
+      preempted (switched out while READY) to running again. Only for tasks
+      that were preempted at least MIN_LATENCY_SAMPLES times, and never for
+      ALL: mixing tasks would let the busiest ones decide the result
+    - contention_per_s: times the task was switched out waiting on a mutex
+      or RW lock
+    - inversions_per_s: times the task got the CPU running at a priority
+      other than its own (ie. priority inheritance kicked in)
+    - activations_per_s: times the task got the CPU
+    """
+    switches = [ev for ev in events if ev.event == 'SWITCH']
+    if len(switches) < 2:
+        raise ValueError("Not enough context switches in the trace")
+    resolution = stamp_resolution(switches)
+    if resolution >= MAX_STAMP_RESOLUTION:
+        raise ValueError("Timestamps are {0} us apart at best. This looks like a tick-stamped capture: "
+                         "rebuild rtemsStats with WITH_INT_TIME".format(resolution // 1000))
+
+    start, end = events[0].stamp, events[-1].stamp
+    span_ns = float(end - start) if end > start else 1.0
+    span_s = span_ns / 1e9
+
+    names = {}
+    cpu = defaultdict(int)
+    isr_in_task = defaultdict(int)
+    activations = defaultdict(int)
+    contention = defaultdict(int)
+    inversions = defaultdict(int)
+    latencies = defaultdict(list)
+    preempted_at = {}
+    isr_open = {}
+    isr_count = 0
+    isr_busy = 0
+
+    running, run_start = None, None
+    for ev in events:
+        if ev.event == 'SWITCH':
+            names[ev.to_id] = ev.to_name
+            names.setdefault(ev.from_id, ev.from_name)
+            if running is not None:
+                cpu[running] += ev.stamp - run_start
+            running, run_start = ev.to_id, ev.stamp
+
+            activations[ev.to_id] += 1
+            if ev.state == 'READY':
+                preempted_at[ev.from_id] = ev.stamp
+            elif any(st in ev.state for st in CONTENTION_STATES):
+                contention[ev.from_id] += 1
+            if ev.to_id in preempted_at:
+                latencies[ev.to_id].append((ev.stamp - preempted_at.pop(ev.to_id)) / 1000.0)
+            if ev.prio_current != ev.prio_real:
+                inversions[ev.to_id] += 1
+        elif ev.event == 'ISR_ENTER':
+            isr_open[ev.to_id] = ev
+        elif ev.event == 'ISR_EXIT':
+            entry = isr_open.pop(ev.to_id, None)
+            if entry is not None:
+                # The measured service time is more precise than the stamps
+                busy = ev.duration if ev.duration is not None else ev.stamp - entry.stamp
+                isr_count += 1
+                isr_busy += busy
+                isr_in_task[entry.from_id] += busy
+    if running is not None:
+        cpu[running] += end - run_start
+
+    metrics = {}
+    for tid, name in names.items():
+        if name == IDLE_NAME:
+            continue
+        metrics['{0}:cpu_pct'.format(name)] = max(0, cpu[tid] - isr_in_task[tid]) * 100.0 / span_ns
+        metrics['{0}:activations_per_s'.format(name)] = activations[tid] / span_s
+        metrics['{0}:contention_per_s'.format(name)] = contention[tid] / span_s
+        metrics['{0}:inversions_per_s'.format(name)] = inversions[tid] / span_s
+        if len(latencies[tid]) >= MIN_LATENCY_SAMPLES:
+            for pct in PERCENTILES:
+                if len(latencies[tid]) * (100 - pct) >= MIN_TAIL_SAMPLES * 100:
+                    metrics['{0}:latency_p{1}_us'.format(name, pct)] = percentile(latencies[tid], pct)
+            metrics['{0}:latency_max_us'.format(name)] = max(latencies[tid])
+
+    metrics['{0}:switches_per_s'.format(ALL)] = len(switches) / span_s
+    metrics['{0}:contention_per_s'.format(ALL)] = sum(contention.values()) / span_s
+    metrics['{0}:inversions_per_s'.format(ALL)] = sum(inversions.values()) / span_s
+    if isr_count > 0:
+        metrics['ISR:count_per_s'] = isr_count / span_s
+        metrics['ISR:busy_pct'] = isr_busy * 100.0 / span_ns
+
+    return metrics
+
+def parse_tolerances(specs):
+    "Turns ['pattern=pct', ...] into [(pattern, pct), ...]"
+    tolerances = []
+    for spec in specs or []:
+        try:
+            pattern, value = spec.rsplit('=', 1)
+            tolerances.append((pattern, float(value)))
+        except ValueError:
+            raise ValueError("Wrong tolerance specification: '{0}'. Expected PATTERN=PERCENT".format(spec))
+    return tolerances
+
+def default_tolerance_for(metric):
+    for suffix, tolerance in DEFAULT_TOLERANCES.items():
+        if metric.endswith(suffix):
+            return tolerance
+    return DEFAULT_TOLERANCE
+
+def tolerance_for(metric, tolerances, default=None):
+    "The last matching pattern wins, so that general rules can go first"
+    result = default if default is not None else default_tolerance_for(metric)
+    for pattern, value in tolerances:
+        if fnmatch.fnmatchcase(metric, pattern):
+            result = value
+    return result
+
+def floor_for(metric):
+    for suffix, floor in DEFAULT_FLOORS.items():
+        if metric.endswith(suffix):
+            return floor
+    return 0.0
+
+def describe(metric):
+    "'scan0.1:latency_p99_us' -> 'scan0.1 latency p99'"
+    task, name = metric.split(':', 1)
+    for suffix in ('_us', '_pct', '_per_s'):
+        if name.endswith(suffix):
+            name = name[:-len(suffix)]
+    return '{0} {1}'.format(task, name.replace('_', ' '))
+
+def task_of(metric):
+    return metric.split(':', 1)[0]
+
+def compare(baseline, candidate, tolerances=None, default_tolerance=None, allow_missing=False):
+    """
+    Returns a list of (metric, base, cand, change_pct, tolerance, regressed).
+    A metric regresses when it goes up by more than its tolerance (in percent
+    of the baseline value) and by more than its absolute floor.
+
+    Metrics that exist only in the baseline come with cand, change_pct and
+    tolerance set to None. They count as regressed when the whole task is
+    gone from the candidate (eg. it hung), unless allow_missing is set. A
+    single metric going away (eg. a percentile without enough samples) is
+    only reported. Metrics that exist only in the candidate are ignored.
+    """
+    results = []
+    candidate_tasks = set(task_of(metric) for metric in candidate)
+    for metric in sorted(baseline):
+        if metric not in candidate:
+            gone = task_of(metric) not in candidate_tasks
+            results.append((metric, baseline[metric], None, None, None, gone and not allow_missing))
+            continue
+        base, cand = baseline[metric], candidate[metric]
+        tolerance = tolerance_for(metric, tolerances or [], default_tolerance)
+        if base != 0:
+            change = (cand - base) * 100.0 / abs(base)
+        else:
+            change = 0.0 if cand == 0 else float('inf')
+        regressed = (not metric.endswith(INFORMATIONAL)
+                     and change > tolerance
+                     and (cand - base) > floor_for(metric))
+        results.append((metric, base, cand, change, tolerance, regressed))
+    return results
+
+def report(results, out, verbose=False):
+    regressions = 0
+    present = set(task_of(r[0]) for r in results if r[2] is not None)
+    reported = set()
+    for metric, base, cand, change, tolerance, regressed in results:
+        if cand is None:
+            task = task_of(metric)
+            if task in present:
+                print("gone: {0} is missing from the candidate ({1:.2f} in the baseline)".format(
+                        describe(metric), base), file=out)
+            elif task not in reported:
+                reported.add(task)
+                if regressed:
+                    regressions += 1
+                print("{0}: {1} is missing from the candidate".format('FAIL' if regressed else 'gone', task), file=out)
+        elif regressed:
+            regressions += 1
+            print("FAIL: {0} regressed {1:.0f}% ({2:.2f} -> {3:.2f}, tolerance {4:.0f}%)".format(
+                    describe(metric), change, base, cand, tolerance), file=out)
+        elif verbose:
+            print("ok:   {0} {1:+.0f}% ({2:.2f} -> {3:.2f})".format(describe(metric), change, base, cand), file=out)
+    return regressions
+
+def cmd_metrics(args):
+    metrics = compute_metrics(load_trace(args.trace))
+    if args.json:
+        json.dump(metrics, sys.stdout, indent=1, sort_keys=True)
+        print()
+    else:
+        for metric in sorted(metrics):
+            print("{0:50s} {1:12.2f}".format(metric, metrics[metric]))
+    return 0
+
+def cmd_diff(args):
+    results = compare(compute_metrics(load_trace(args.baseline)),
+                      compute_metrics(load_trace(args.candidate)),
+                      parse_tolerances(args.tol), args.tolerance, args.allow_missing)
+    regressions = report(results, sys.stdout, args.verbose)
+    print("{0} regression(s) in {1} metrics".format(regressions, len(results)))
+    return 1 if regressions > 0 else 0
+
+def cmd_corpus(args):
+    """
+    Runs the checks listed in DIR/CHECKS. Each line has a baseline, a
+    candidate, the expected outcome ('pass' or 'fail') and, optionally,
+    tolerance specifications. Fails if any outcome differs from the expected
+    one.
+    """
+    checks_file = os.path.join(args.dir, 'CHECKS')
+    failures = 0
+    total = 0
+    cache = {}
+
+    def metrics_for(name):
+        if name not in cache:
+            cache[name] = compute_metrics(load_trace(os.path.join(args.dir, name)))
+        return cache[name]
+
+    with open(checks_file) as checks:
+        for lineno, line in enumerate(checks, 1):
+            line = line.split('#', 1)[0].strip()
+            if not line:
+                continue
+            fields = line.split()
+            if len(fields) < 3 or fields[2] not in ('pass', 'fail'):
+                print("{0}:{1}: malformed check".format(checks_file, lineno))
+                return 2
+            baseline, candidate, expected = fields[:3]
+            total += 1
+            results = compare(metrics_for(baseline), metrics_for(candidate),
+                              parse_tolerances(fields[3:]), args.tolerance)
+            regressions = sum(1 for r in results if r[-1])
+            outcome = 'fail' if regressions > 0 else 'pass'
+            status = 'ok' if outcome == expected else 'UNEXPECTED'
+            print("{0:10s} {1} -> {2}: {3} (expected {4})".format(status, baseline, candidate, outcome, expected))
+            if outcome != expected:
+                failures += 1
+                report(results, sys.stdout)
+            elif args.verbose:
+                report(results, sys.stdout)
+
+    print("{0} of {1} checks behaved as expected".format(total - failures, total))
+    return 1 if failures > 0 else 0
+
+def parse_args():
+    parser = argparse.ArgumentParser(description = "RTEMS/EPICS trace metrics and regression checks")
+    sub = parser.add_subparsers(dest='command')
+
+    met = sub.add_parser('metrics', help='Compute the metrics for a capture')
+    met.add_argument('--json', action='store_true', help='Output JSON instead of a table')
+    met.add_argument('trace', help='CSV capture, as produced by monitor.py --format csv (may be gzipped)')
+    met.set_defaults(func=cmd_metrics)
+
+    diff = sub.add_parser('diff', help='Compare two captures. Exits with 1 if anything regressed')
+    diff.add_argument('-v', dest='verbose', action='store_true', help='Show the metrics that did not regress, too')
+    diff.add_argument('--tolerance', type=float,
+                      help='Default tolerance, in percent (default: 40 for latencies, 20 for the rest)')
+    diff.add_argument('--tol', action='append', metavar='PATTERN=PERCENT',
+                      help="Tolerance for the metrics matching a pattern, eg. 'scan*:latency_p99_us=40'. Can be repeated")
+    diff.add_argument('--allow-missing', action='store_true',
+                      help="Don't fail when a task from the baseline is missing from the candidate")
+    diff.add_argument('baseline')
+    diff.add_argument('candidate')
+    diff.set_defaults(func=cmd_diff)
+
+    corpus = sub.add_parser('corpus', help='Run the checks listed in a directory of reference traces')
+    corpus.add_argument('-v', dest='verbose', action='store_true', help='Show every metric')
+    corpus.add_argument('--tolerance', type=float,
+                        help='Default tolerance, in percent (default: 40 for latencies, 20 for the rest)')
+    corpus.add_argument('dir', help='Directory with the traces and the CHECKS file')
+    corpus.set_defaults(func=cmd_corpus)
+
+    args = parser.parse_args()
+    if getattr(args, 'func', None) is None:
+        parser.error('Missing command')
+    return args
+
+if __name__=='__main__':
+    args = parse_args()
+    try:
+        sys.exit(args.func(args))
+    except (IOError, ValueError) as exc:
+        print("Error: {0}".format(exc), file=sys.stderr)
+        sys.exit(2)
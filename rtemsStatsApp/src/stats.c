@@ -12,24 +12,32 @@
 
 #include <rtems.h>
 #include <rtems/extension.h>
+#if defined(WITH_ISR_STATS)
+#include <rtems/irq-extension.h>
+#endif
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 static void rtems_stats_switching_context(rtems_tcb *, rtems_tcb *);
 static void rtems_stats_task_begins(rtems_tcb *);
 static void rtems_stats_task_exits(rtems_tcb *);
 static int  rtems_stats_enabled(void);
+static int  rtems_stats_install(void);
 static int  rtems_stats_enable(void);
 static void rtems_stats_disable(void);
-static void rtems_stats_snapshot(int);
+static void rtems_stats_snapshot(int, const char *);
+static void rtems_stats_start_budget_task(void *);
 
 #define MAX_EVENTS 4096
 
 typedef enum {
 	SWITCH,
 	BEGIN,
-	EXIT
+	EXIT,
+	ISR_ENTER,
+	ISR_EXIT
 } rtems_stats_event_type;
 
 #define EVENT_GET_TYPE(ev)          ((rtems_stats_event_type)(ev->misc & 0xFF))
@@ -62,20 +70,25 @@ typedef struct {
 #define MAX_TASKS 256
 #define ARRAY_IDS_SIZE (MAX_TASKS / 32)
 
+#define IDLE_TASK_ID 0x9010001u
+
 #define INCR_RB_POINTER(x) (x = (x + 1) % MAX_EVENTS)
-#define SET_ACTIVE_TASK(prb, tid) { if (tid != 0x9010001u) prb->ids[(tid & 0xff) / 32] |= 1 << (tid % 32);  }
+#define SET_ACTIVE_TASK(prb, tid) { if (tid != IDLE_TASK_ID) prb->ids[(tid & 0xff) / 32] |= 1 << (tid % 32);  }
+#define COUNT_ACTIVATION(prb, tid) { if (tid != IDLE_TASK_ID) prb->activations[tid & 0xff]++; }
 typedef struct {
 	struct timespec stamp;
 	unsigned ticks;
 	unsigned num_events;
 	unsigned head;
 	uint32_t ids[ARRAY_IDS_SIZE];
+	uint32_t activations[MAX_TASKS];
 	RTEMS_STATS_EVENT  thread_activations[MAX_EVENTS];
 } rtems_stats_ring_buffer;
 
 static rtems_stats_ring_buffer rb[2];
 static rtems_stats_ring_buffer *rb_active = &rb[0];
 static rtems_stats_ring_buffer *rb_export = &rb[1];
+static rtems_stats_ring_buffer rb_snap;
 
 static void rtems_stats_reset_rb(rtems_stats_ring_buffer *);
 static rtems_stats_ring_buffer *rtems_stats_switch_rb(void);
@@ -88,8 +101,46 @@ static rtems_extensions_table rtems_stats_extension_table = {
 
 
 
+/*
+ * The module keeps track of the time it spends in the extension hooks, in the
+ * interrupt wrappers (minus the handlers themselves) and in the export
+ * support. A low priority task (rtemsStatsBudget) turns that into a
+ * percentage of CPU every RTEMS_STATS_BUDGET_PERIOD seconds, whether anyone
+ * is reading the exports or not. If an overhead budget is set and the module
+ * goes over it for RTEMS_STATS_BUDGET_STRIKES consecutive checks, it degrades
+ * one step at a time: from raw tracing to aggregated counters (only
+ * activations per task are kept), and from there to disabled. Re-enabling the
+ * module goes back to raw tracing.
+ */
+typedef enum {
+	RTEMS_STATS_MODE_OFF,
+	RTEMS_STATS_MODE_AGGREGATE,
+	RTEMS_STATS_MODE_TRACE
+} rtems_stats_mode;
+
+static const char *rtems_stats_mode_names[] = {"disabled", "aggregated counters", "raw tracing"};
+
+#define RTEMS_STATS_BUDGET_STRIKES 5
+#define RTEMS_STATS_BUDGET_PERIOD  0.2
+
+static volatile rtems_stats_mode rtems_stats_current_mode = RTEMS_STATS_MODE_OFF;
+static double   rtems_stats_budget = 0.0;       // In percent of CPU. 0 means no budget
+static double   rtems_stats_overhead = 0.0;     // In percent of CPU, as of the last check
+static unsigned rtems_stats_budget_strikes = 0;
+static volatile uint64_t rtems_stats_hooks_ns = 0;
+static volatile uint64_t rtems_stats_isr_ns = 0;
+static volatile uint64_t rtems_stats_export_ns = 0;
+static uint64_t rtems_stats_last_check = 0;
+static epicsThreadOnceId rtems_stats_budget_once = EPICS_THREAD_ONCE_INIT;
+
+static volatile int rtems_stats_tracing = 0;
 static int rtems_taking_snapshot = 0;
 static int rtems_snapshot_count = 0;
+static int rtems_snapshot_busy = 0;
+static char rtems_snapshot_path[256];
+
+// Snapshots are captured into their own buffer, leaving the continuous mode ones alone
+#define RB_CAPTURE (rtems_taking_snapshot ? &rb_snap : rb_active)
 static int rb_switch_trigger = 0;
 
 static rtems_id rtems_stats_extension_table_id;
@@ -102,13 +153,21 @@ int rtems_stats_enabled(void) {
 	return rtems_extension_ident(rtems_stats_table_name, &id);
 }
 
-int rtems_stats_enable(void) {
+// Installs the hooks. Used both by the continuous mode and by the snapshots
+int rtems_stats_install(void) {
 	rtems_status_code ret;
 	char name[10], *res;
 
 	if (rtems_stats_enabled() == RTEMS_SUCCESSFUL)
 		return 0;
 
+	// Start measuring the overhead from scratch
+	rtems_stats_hooks_ns = 0;
+	rtems_stats_isr_ns = 0;
+	rtems_stats_export_ns = 0;
+	rtems_stats_last_check = 0;
+	epicsThreadOnce(&rtems_stats_budget_once, rtems_stats_start_budget_task, NULL);
+
 	// Created with count 0: used for synchronization
 	if(rtems_semaphore_create(rtems_build_name('S', 'T', 'S', 'M'), 0,
 			       RTEMS_SIMPLE_BINARY_SEMAPHORE, 0, &rtems_stats_sem) != RTEMS_SUCCESSFUL)
@@ -139,13 +198,44 @@ int rtems_stats_enable(void) {
 		return 1;
 	}
 	else {
+		rtems_stats_current_mode = RTEMS_STATS_MODE_TRACE;
+		rtems_stats_budget_strikes = 0;
+		rtems_stats_tracing = 1;
 		errlogMessage("rtemsStats enabled\n");
 		return 0;
 	}
 }
 
+/*
+ * Until the snapshot task is done with it, the extension belongs to the
+ * snapshot: enabling the continuous mode on top of it would get torn down
+ * as soon as the snapshot is written out.
+ */
+int rtems_stats_enable(void) {
+	if (rtems_snapshot_busy) {
+		errlogMessage("rtemsStats is taking a snapshot. Try again when it's done\n");
+		return 1;
+	}
+
+	// The budget may have stepped us down, leaving the hooks in place
+	if ((rtems_stats_enabled() == RTEMS_SUCCESSFUL) &&
+	    (rtems_stats_current_mode == RTEMS_STATS_MODE_AGGREGATE)) {
+		rtems_stats_budget_strikes = 0;
+		rtems_stats_tracing = 1;
+		rtems_stats_current_mode = RTEMS_STATS_MODE_TRACE;
+		errlogPrintf("rtemsStats: switching from %s back to %s\n",
+			     rtems_stats_mode_names[RTEMS_STATS_MODE_AGGREGATE],
+			     rtems_stats_mode_names[RTEMS_STATS_MODE_TRACE]);
+		return 0;
+	}
+
+	return rtems_stats_install();
+}
+
 void rtems_stats_disable(void) {
 	if (rtems_extension_delete(rtems_stats_extension_table_id) == RTEMS_SUCCESSFUL) {
+		rtems_stats_tracing = 0;
+		rtems_stats_current_mode = RTEMS_STATS_MODE_OFF;
 		rtems_semaphore_delete(rtems_stats_sem);
 		rtems_stats_extension_table_id = 0;
 		errlogMessage("rtemsStats disabled\n");
@@ -155,123 +245,233 @@ void rtems_stats_disable(void) {
 	}
 }
 
-static void rtems_stats_print_state(States_Control state, int nl) {
-	char *mess = NULL;
-	const char *state_text;
-	char *tmp;
-	int first = 1;
-	States_Control current;
+typedef struct {
+	States_Control mask;
+	const char *text;
+} rtems_stats_state_name;
+
+// NOTE: This list is valid for RTEMS 4.10. It may change across versions
+static const rtems_stats_state_name rtems_stats_state_names[] = {
+	{ STATES_DORMANT,                        "DORMANT" },
+	{ STATES_SUSPENDED,                      "SUSPENDED" },
+	{ STATES_TRANSIENT,                      "TRANSIENT" },
+	{ STATES_DELAYING,                       "DELAYING" },
+	{ STATES_WAITING_FOR_TIME,               "WAITING FOR TIME" },
+	{ STATES_WAITING_FOR_BUFFER,             "WAITING FOR BUFFER" },
+	{ STATES_WAITING_FOR_SEGMENT,            "WAITING FOR SEGMENT" },
+	{ STATES_WAITING_FOR_MESSAGE,            "WAITING FOR MESSAGE" },
+	{ STATES_WAITING_FOR_EVENT,              "WAITING FOR EVENT" },
+	{ STATES_WAITING_FOR_SEMAPHORE,          "WAITING FOR SEMAPHORE" },
+	{ STATES_WAITING_FOR_MUTEX,              "WAITING FOR MUTEX" },
+	{ STATES_WAITING_FOR_CONDITION_VARIABLE, "WAITING FOR CONDITION VARIABLE" },
+	{ STATES_WAITING_FOR_JOIN_AT_EXIT,       "WAITING FOR JOIN AT EXIT" },
+	{ STATES_WAITING_FOR_RPC_REPLY,          "WAITING FOR RPC REPLY" },
+	{ STATES_WAITING_FOR_PERIOD,             "WAITING FOR PERIOD" },
+	{ STATES_WAITING_FOR_SIGNAL,             "WAITING FOR SIGNAL" },
+	{ STATES_WAITING_FOR_BARRIER,            "WAITING FOR BARRIER" },
+	{ STATES_WAITING_FOR_RWLOCK,             "WAITING FOR RW LOCK" },
+	{ STATES_INTERRUPTIBLE_BY_SIGNAL,        "INTERRUPTIBLE BY SIGNAL" },
+};
+
+#define NUM_STATE_NAMES (sizeof(rtems_stats_state_names) / sizeof(rtems_stats_state_name))
+
+// Appends src to buf, never going past size (including the terminator). Returns the new length
+static size_t rtems_stats_append(char *buf, size_t len, size_t size, const char *src) {
+	size_t n = strlen(src);
+
+	if (len + n >= size)
+		n = (len < size - 1) ? (size - 1 - len) : 0;
+	memcpy(buf + len, src, n);
+	buf[len + n] = '\0';
+
+	return len + n;
+}
+
+static void rtems_stats_format_state(char *buf, size_t size, States_Control state) {
+	size_t len = 0;
+	unsigned i;
 
+	buf[0] = '\0';
 	if (state == STATES_READY) {
-		asprintf(&mess, "(READY");
+		rtems_stats_append(buf, 0, size, "READY");
+		return;
 	}
-	else {
-		if (state & STATES_DORMANT) {
-			asprintf(&mess, "(DORMANT");
-			first = 0;
-		}
-		else {
-			asprintf(&mess, "(");
-		}
 
-		for (current = 1; current != 0x80000000; current <<= 1) {
-			if (current & state) {
-				switch(current & state) {
-					case STATES_SUSPENDED:		   state_text = "SUSPENDED"; break;
-					case STATES_TRANSIENT:		   state_text = "TRANSIENT"; break;
-					case STATES_DELAYING:		   state_text = "DELAYING"; break;
-					case STATES_DORMANT:		   state_text = "DORMANT"; break;
-					case STATES_WAITING_FOR_TIME:	   state_text = "WAITING FOR TIME"; break;
-					case STATES_WAITING_FOR_BUFFER:	   state_text = "WAITING FOR BUFFER"; break;
-					case STATES_WAITING_FOR_SEGMENT:   state_text = "WAITING FOR SEGMENT"; break;
-					case STATES_WAITING_FOR_MESSAGE:   state_text = "WAITING FOR MESSAGE"; break;
-					case STATES_WAITING_FOR_SEMAPHORE: state_text = "WAITING FOR SEMAPHORE"; break;
-					case STATES_WAITING_FOR_MUTEX:     state_text = "WAITING FOR MUTEX"; break;
-					case STATES_WAITING_FOR_EVENT:     state_text = "WAITING FOR EVENT"; break;
-					case STATES_WAITING_FOR_CONDITION_VARIABLE:
-									   state_text = "WAITING FOR CONDITION VARIABLE"; break;
-					case STATES_WAITING_FOR_PERIOD:	   state_text = "WAITING FOR PERIOD"; break;
-					case STATES_WAITING_FOR_SIGNAL:	   state_text = "WAITING FOR SIGNAL"; break;
-					case STATES_WAITING_FOR_BARRIER:   state_text = "WAITING FOR BARRIER"; break;
-					case STATES_WAITING_FOR_RWLOCK:	   state_text = "WAITING FOR RWLock"; break;
-					case STATES_WAITING_FOR_JOIN_AT_EXIT:
-									   state_text = "WAITING FOR JOIN AT EXIT"; break;
-					case STATES_INTERRUPTIBLE_BY_SIGNAL:
-									   state_text = "INTERRUPTIBLE BY SIGNAL"; break;
-					case STATES_WAITING_FOR_RPC_REPLY: state_text = "WAITING FOR RPC REPLY"; break;
-					default:
-					     state_text = "UNKNOWN"; break;
-				}
-				if (!first) {
-					asprintf(&tmp, "%s|%s", mess, state_text);
-					first = 0;
-				}
-				else {
-					asprintf(&tmp, "%s%s", mess, state_text);
-				}
-				free(mess);
-				mess = tmp;
-			}
+	for (i = 0; i < NUM_STATE_NAMES; i++) {
+		if (state & rtems_stats_state_names[i].mask) {
+			if (len > 0)
+				len = rtems_stats_append(buf, len, size, ", ");
+			len = rtems_stats_append(buf, len, size, rtems_stats_state_names[i].text);
 		}
 	}
-	if (nl != 0)
-		errlogPrintf("%s)\n", mess);
+
+	if (len == 0)
+		rtems_stats_append(buf, 0, size, "UNKNOWN");
+}
+
+// Same convention as the client: EPICS priorities when they map, RTEMS ones preceded by '*' otherwise
+static void rtems_stats_format_prio(char *buf, size_t size, unsigned prio) {
+	int epics_prio = 199 - (int)prio;
+
+	if ((epics_prio >= epicsThreadPriorityMin) && (epics_prio <= epicsThreadPriorityMax))
+		snprintf(buf, size, " %03d", epics_prio);
 	else
-		errlogPrintf("%s)", mess);
-	free(mess);
+		snprintf(buf, size, "*%03u", prio);
 }
 
-void rtems_stats_show(rtems_stats_ring_buffer *tgt_rb) {
-	errlogMessage("Currently not displaying stats\n");
+// Task names are looked up once per snapshot, before formatting
+static char rtems_snapshot_names[MAX_TASKS][MAX_STRING_SIZE];
 
+static void rtems_stats_collect_names(rtems_stats_ring_buffer *tgt_rb) {
+	unsigned i;
+
+	memset(rtems_snapshot_names, 0, sizeof(rtems_snapshot_names));
+	for (i = 0; i < MAX_TASKS; i++) {
+		if (tgt_rb->ids[i / 32] & (1 << (i % 32)))
+			epicsThreadGetName((epicsThreadId)(0xa010000 + i), rtems_snapshot_names[i], MAX_STRING_SIZE);
+	}
+}
+
+static const char *rtems_stats_task_name(rtems_id id, char *fallback, size_t size) {
+	if (id == IDLE_TASK_ID)
+		return "IDLE";
+
+	if (((id & 0xffffff00) == 0xa010000) && (rtems_snapshot_names[id & 0xff][0] != '\0'))
+		return rtems_snapshot_names[id & 0xff];
+
+	snprintf(fallback, size, "%#08x", (unsigned)id);
+	return fallback;
+}
+
+static void rtems_stats_format_stamp(char *buf, size_t size, rtems_stats_ring_buffer *tgt_rb, RTEMS_STATS_EVENT *ev) {
+	char tstamp_sec[30];
+	struct tm t;
+	time_t sec;
+	unsigned long nsec;
+
+#if defined(WITH_INT_TIME)
+	sec  = ev->stamp.tv_sec;
+	nsec = ev->stamp.tv_nsec;
+#else
+	// Extrapolate from the timestamp taken when resetting the buffer
+	uint64_t ns = (uint64_t)(ev->ticks - tgt_rb->ticks) * (1000000000ull / rtems_clock_get_ticks_per_second());
+
+	ns  += tgt_rb->stamp.tv_nsec;
+	sec  = tgt_rb->stamp.tv_sec + (time_t)(ns / 1000000000ull);
+	nsec = (unsigned long)(ns % 1000000000ull);
+#endif
+
+	if ((gmtime_r(&sec, &t) != NULL) && (strftime(tstamp_sec, sizeof(tstamp_sec), "%Y-%m-%dT%H:%M:%S", &t) > 0))
+		snprintf(buf, size, "%s.%09lu", tstamp_sec, nsec);
+	else
+		snprintf(buf, size, "(no timestamp)");
+}
+
+/*
+ * Prints out the events in the same format as the console output of the
+ * client. Everything is formatted into buffers on the stack: nothing gets
+ * allocated, and errlog is kept out of the way.
+ */
+static void rtems_stats_write_snapshot(FILE *out, rtems_stats_ring_buffer *tgt_rb) {
+	char line[256];
+	char stamp[48];
+	char state[160];
+	char pcur[8], preal[8];
+	char fallback_a[16], fallback_b[16];
 	unsigned current_event;
 	unsigned count;
+	unsigned nevents;
+	rtems_id prev_id = 0;
+
+	rtems_stats_collect_names(tgt_rb);
 
-	unsigned prev_id = 0;
+	nevents = tgt_rb->num_events < MAX_EVENTS ? tgt_rb->num_events : MAX_EVENTS;
+	current_event = tgt_rb->num_events > MAX_EVENTS ? tgt_rb->head : 0;
 
-	for (count = 0, current_event = tgt_rb->head; count < tgt_rb->num_events; INCR_RB_POINTER(current_event), count++)
+	for (count = 0; count < nevents; INCR_RB_POINTER(current_event), count++)
 	{
 		RTEMS_STATS_EVENT *ce = &tgt_rb->thread_activations[current_event];
-		unsigned known = 1;
+		const char *name = rtems_stats_task_name(ce->obj_id, fallback_b, sizeof(fallback_b));
+
+		rtems_stats_format_stamp(stamp, sizeof(stamp), tgt_rb, ce);
 		switch(EVENT_GET_TYPE(ce)) {
 			case SWITCH:
 				if (prev_id == 0)
 					break;
-				errlogPrintf("S | %x | %x | ", (unsigned int)prev_id,
-							       (unsigned int)ce->obj_id);
+				rtems_stats_format_state(state, sizeof(state), ce->state);
+				rtems_stats_format_prio(preal, sizeof(preal), EVENT_GET_PRIO_REAL(ce));
+				if (EVENT_GET_PRIO_CURRENT(ce) == EVENT_GET_PRIO_REAL(ce))
+					strcpy(pcur, " ---");
+				else
+					rtems_stats_format_prio(pcur, sizeof(pcur), EVENT_GET_PRIO_CURRENT(ce));
+
+				if (ce->wait_id != 0)
+					snprintf(line, sizeof(line), "%s: %-20s -> %-20s %s/%s (%s, %#08x)\n", stamp,
+						 rtems_stats_task_name(prev_id, fallback_a, sizeof(fallback_a)), name,
+						 pcur, preal, state, (unsigned)ce->wait_id);
+				else
+					snprintf(line, sizeof(line), "%s: %-20s -> %-20s %s/%s (%s)\n", stamp,
+						 rtems_stats_task_name(prev_id, fallback_a, sizeof(fallback_a)), name,
+						 pcur, preal, state);
+				fputs(line, out);
 				break;
 			case BEGIN:
-				errlogPrintf("E |         | %x | ", (unsigned int)ce->obj_id);
+				snprintf(line, sizeof(line), "%s: %-20s begins\n", stamp, name);
+				fputs(line, out);
 				break;
 			case EXIT:
-				errlogPrintf("B | %x |         | ", (unsigned int)ce->obj_id);
+				snprintf(line, sizeof(line), "%s: %-20s exits\n", stamp, name);
+				fputs(line, out);
 				break;
 			default:
-				errlogPrintf("U | ****\n");
-				known = 0;
+				snprintf(line, sizeof(line), "%s: unknown event type %u\n", stamp, (unsigned)EVENT_GET_TYPE(ce));
+				fputs(line, out);
 				break;
 		}
-		if (known) {
-#if defined(WITH_INT_TIME)
-			char tstamp_sec[30];
-			struct tm t;
+		prev_id = ce->obj_id;
+	}
+}
 
-			if (gmtime_r(&(ce->stamp.tv_sec), &t) != NULL) {
-				if (strftime(tstamp_sec, sizeof(tstamp_sec), "%Y-%m-%dT%H:%M:%S", &t) > 0) {
-					errlogPrintf("%s.%09lu | ", tstamp_sec, ce->stamp.tv_nsec);
-				}
+// Waits for the capture to finish and writes it out, out of the way of iocsh
+static void rtems_stats_snapshot_task(void *unused) {
+	rtems_status_code got_lock;
+	FILE *out = stdout;
+
+	got_lock = rtems_semaphore_obtain(rtems_stats_sem, RTEMS_WAIT, 10000);
+	rtems_stats_disable();
+	rtems_taking_snapshot = 0;
+
+	if (got_lock == RTEMS_SUCCESSFUL) {
+		if (rtems_snapshot_path[0] != '\0') {
+			if ((out = fopen(rtems_snapshot_path, "w")) == NULL)
+				errlogPrintf("rtemsStats: can't open %s for writing\n", rtems_snapshot_path);
+		}
+		if (out != NULL) {
+			rtems_stats_write_snapshot(out, &rb_snap);
+			if (out != stdout) {
+				fclose(out);
+				errlogPrintf("rtemsStats: snapshot written to %s\n", rtems_snapshot_path);
+			}
+			else {
+				fflush(out);
 			}
-#else
-			errlogPrintf("%lu | ", ce->ticks);
-#endif
-			rtems_stats_print_state(ce->state, 1);
 		}
-		prev_id = ce->obj_id;
 	}
+	else {
+		switch (got_lock) {
+			case RTEMS_TIMEOUT:
+				errlogMessage("Timed out waiting for the info to be collected\n");
+				break;
+			default:
+				errlogMessage("Can't acquire the semaphore, somehow...\n");
+				break;
+		}
+	}
+
+	rtems_snapshot_busy = 0;
 }
 
-void rtems_stats_snapshot(int count) {
-	rtems_stats_ring_buffer *local_rb = rb_active;
+void rtems_stats_snapshot(int count, const char *path) {
 	if ((count < 0) || (count > MAX_EVENTS)) {
 		errlogPrintf("Wrong number of events. Must be: 0 <= ev < %d; with 0 = max\n", MAX_EVENTS);
 		return;
@@ -285,33 +485,41 @@ void rtems_stats_snapshot(int count) {
 		return;
 	}
 
-	printf("Taking %d events\n", count);
-	rtems_stats_reset_rb(local_rb);
-	rtems_taking_snapshot = 1;
-	rtems_snapshot_count = count;
-	rtems_stats_enable();
-	if (rtems_stats_enabled() == RTEMS_SUCCESSFUL) {
-		rtems_status_code got_lock;
+	if (rtems_snapshot_busy) {
+		errlogMessage("rtemsStats is already taking a snapshot\n");
+		return;
+	}
 
-		got_lock = rtems_semaphore_obtain(rtems_stats_sem, RTEMS_WAIT, 10000);
-		rtems_stats_disable();
-		if (got_lock == RTEMS_SUCCESSFUL) {
-			rtems_stats_show(local_rb);
-		}
-		else {
-			switch (got_lock) {
-				case RTEMS_TIMEOUT:
-					errlogMessage("Timed out waiting for the info to be collected\n");
-					break;
-				default:
-					errlogMessage("Can't acquire the semaphore, somehow...\n");
-					break;
-			}
-		}
+	if (path != NULL) {
+		strncpy(rtems_snapshot_path, path, sizeof(rtems_snapshot_path) - 1);
+		rtems_snapshot_path[sizeof(rtems_snapshot_path) - 1] = '\0';
 	}
 	else {
+		rtems_snapshot_path[0] = '\0';
+	}
+
+	rtems_snapshot_busy = 1;
+	rtems_stats_reset_rb(&rb_snap);
+	rtems_snapshot_count = count;
+	rtems_taking_snapshot = 1;
+	rtems_stats_install();
+	if (rtems_stats_enabled() != RTEMS_SUCCESSFUL) {
 		rtems_taking_snapshot = 0;
+		rtems_snapshot_busy = 0;
+		return;
 	}
+
+	if (epicsThreadCreate("rtemsStatsSnap", epicsThreadPriorityLow,
+			      epicsThreadGetStackSize(epicsThreadStackMedium),
+			      rtems_stats_snapshot_task, NULL) == NULL) {
+		errlogMessage("Can't create the snapshot task\n");
+		rtems_stats_disable();
+		rtems_taking_snapshot = 0;
+		rtems_snapshot_busy = 0;
+		return;
+	}
+
+	printf("Taking %d events in the background\n", count);
 }
 
 static void epicsTimeToTimespecInt(struct timespec *ts, epicsTimeStamp *ets) {
@@ -354,19 +562,18 @@ rtems_stats_ring_buffer *rtems_stats_switch_rb(void) {
 	return rb_export;
 }
 
-static void rtems_stats_add_event(RTEMS_STATS_EVENT *evt) {
-	unsigned index;
-#if defined(WITH_INT_TIME)
-	epicsTimeStamp now;
-#endif
+static uint64_t rtems_stats_uptime_ns(void) {
+	struct timespec now;
 
-	if (rb_switch_trigger == 1) {
-		rb_switch_trigger = 0;
-		RB_SWAP;
-		rtems_semaphore_release(rtems_stats_sem);
-	}
+	rtems_clock_get_uptime(&now);
+	return ((uint64_t)now.tv_sec * 1000000000ull) + now.tv_nsec;
+}
 
+// Safe to call from interrupt context: epicsTimeGetCurrentInt exists for that purpose
+static void rtems_stats_stamp_event(RTEMS_STATS_EVENT *evt) {
 #if defined(WITH_INT_TIME)
+	epicsTimeStamp now;
+
 	if (epicsTimeGetCurrentInt(&now) == epicsTimeOK) {
 	   epicsTimeToTimespec(&evt->stamp, &now);
 	}
@@ -377,52 +584,428 @@ static void rtems_stats_add_event(RTEMS_STATS_EVENT *evt) {
 #else
 	evt->ticks = rtems_clock_get_ticks_since_boot();
 #endif
-	index = rb_active->num_events % MAX_EVENTS;
-	memcpy(&rb_active->thread_activations[index], evt, sizeof(RTEMS_STATS_EVENT));
-	rb_active->num_events++;
-	if (index == rb_active->head)
-		INCR_RB_POINTER(rb_active->head);
+}
+
+static void rtems_stats_check_rb_switch(void) {
+	if (rb_switch_trigger == 1) {
+		rb_switch_trigger = 0;
+		RB_SWAP;
+		rtems_semaphore_release(rtems_stats_sem);
+	}
+}
+
+static void rtems_stats_add_event(RTEMS_STATS_EVENT *evt) {
+	rtems_stats_ring_buffer *target = RB_CAPTURE;
+	unsigned index;
+
+	rtems_stats_stamp_event(evt);
+	index = target->num_events % MAX_EVENTS;
+	memcpy(&target->thread_activations[index], evt, sizeof(RTEMS_STATS_EVENT));
+	target->num_events++;
+	if (index == target->head)
+		INCR_RB_POINTER(target->head);
 
 	if (rtems_taking_snapshot) {
 		rtems_snapshot_count--;
-		if ((rb_active->num_events >= MAX_EVENTS) || (rtems_snapshot_count < 1)) {
+		if ((target->num_events >= MAX_EVENTS) || (rtems_snapshot_count < 1)) {
+			// Stop recording right away. The snapshot task removes the hooks later
+			rtems_stats_tracing = 0;
+			rtems_stats_current_mode = RTEMS_STATS_MODE_OFF;
 			rtems_taking_snapshot = 0;
-			RB_SWAP;
 			rtems_semaphore_release(rtems_stats_sem);
 		}
 	}
 }
 
 void rtems_stats_switching_context(rtems_tcb *active, rtems_tcb *heir) {
-	RTEMS_STATS_EVENT evt = {
-		.misc = EVENT_SET_MISC(SWITCH, heir->current_priority, heir->real_priority),
-		.state = active->current_state,
-		.obj_id  = heir->Object.id,
-		.wait_id = active->Wait.id
-	};
+	uint64_t start;
+
+	if (rtems_stats_current_mode == RTEMS_STATS_MODE_OFF)
+		return;
+
+	start = rtems_stats_uptime_ns();
+
+	rtems_stats_check_rb_switch();
+	SET_ACTIVE_TASK(RB_CAPTURE, heir->Object.id);
+	COUNT_ACTIVATION(RB_CAPTURE, heir->Object.id);
 
-	SET_ACTIVE_TASK(rb_active, heir->Object.id);
-	rtems_stats_add_event(&evt);
+	if (rtems_stats_current_mode == RTEMS_STATS_MODE_TRACE) {
+		RTEMS_STATS_EVENT evt = {
+			.misc = EVENT_SET_MISC(SWITCH, heir->current_priority, heir->real_priority),
+			.state = active->current_state,
+			.obj_id  = heir->Object.id,
+			.wait_id = active->Wait.id
+		};
+
+		rtems_stats_add_event(&evt);
+	}
+
+	rtems_stats_hooks_ns += rtems_stats_uptime_ns() - start;
 }
 
 void rtems_stats_task_begins(rtems_tcb *task) {
-	RTEMS_STATS_EVENT evt = {
-		.misc = EVENT_SET_MISC(BEGIN, task->current_priority, task->real_priority),
-		.obj_id = task->Object.id
-	};
+	uint64_t start;
 
-	SET_ACTIVE_TASK(rb_active, task->Object.id);
-	rtems_stats_add_event(&evt);
+	if (rtems_stats_current_mode == RTEMS_STATS_MODE_OFF)
+		return;
+
+	start = rtems_stats_uptime_ns();
+
+	rtems_stats_check_rb_switch();
+	SET_ACTIVE_TASK(RB_CAPTURE, task->Object.id);
+
+	if (rtems_stats_current_mode == RTEMS_STATS_MODE_TRACE) {
+		RTEMS_STATS_EVENT evt = {
+			.misc = EVENT_SET_MISC(BEGIN, task->current_priority, task->real_priority),
+			.obj_id = task->Object.id
+		};
+
+		rtems_stats_add_event(&evt);
+	}
+
+	rtems_stats_hooks_ns += rtems_stats_uptime_ns() - start;
 }
 
 void rtems_stats_task_exits(rtems_tcb *task) {
+	uint64_t start;
+
+	if (rtems_stats_current_mode == RTEMS_STATS_MODE_OFF)
+		return;
+
+	start = rtems_stats_uptime_ns();
+
+	rtems_stats_check_rb_switch();
+	SET_ACTIVE_TASK(RB_CAPTURE, task->Object.id);
+
+	if (rtems_stats_current_mode == RTEMS_STATS_MODE_TRACE) {
+		RTEMS_STATS_EVENT evt = {
+			.misc = EVENT_SET_MISC(EXIT, task->current_priority, task->real_priority),
+			.obj_id = task->Object.id
+		};
+
+		rtems_stats_add_event(&evt);
+	}
+
+	rtems_stats_hooks_ns += rtems_stats_uptime_ns() - start;
+}
+
+// Adds to one of the overhead counters. They're 64 bit, and may be touched from interrupts
+static void rtems_stats_charge(volatile uint64_t *counter, uint64_t ns) {
+	rtems_interrupt_level level;
+
+	rtems_interrupt_disable(level);
+	*counter += ns;
+	rtems_interrupt_enable(level);
+}
+
+/*
+ * Computes the overhead since the last call, as a percentage of the elapsed
+ * time, and steps down one mode if we've been over budget for long enough.
+ * The budget is not enforced on snapshots, only measured.
+ * Called periodically from rtemsStatsBudget, which is the only place that
+ * resets the counters.
+ */
+static void rtems_stats_check_budget(void) {
+	uint64_t now = rtems_stats_uptime_ns();
+	uint64_t overhead;
+	rtems_interrupt_level level;
+
+	// The hooks may update the counters under our feet
+	rtems_interrupt_disable(level);
+	overhead = rtems_stats_hooks_ns + rtems_stats_isr_ns + rtems_stats_export_ns;
+	rtems_stats_hooks_ns = 0;
+	rtems_stats_isr_ns = 0;
+	rtems_stats_export_ns = 0;
+	rtems_interrupt_enable(level);
+
+	if ((rtems_stats_last_check == 0) || (now <= rtems_stats_last_check)) {
+		rtems_stats_last_check = now;
+		return;
+	}
+
+	rtems_stats_overhead = (overhead * 100.0) / (now - rtems_stats_last_check);
+	rtems_stats_last_check = now;
+
+	// Snapshots are short and bounded: stepping down would only lose them
+	if ((rtems_stats_budget <= 0.0) || (rtems_stats_overhead <= rtems_stats_budget) || rtems_snapshot_busy) {
+		rtems_stats_budget_strikes = 0;
+		return;
+	}
+
+	if (++rtems_stats_budget_strikes < RTEMS_STATS_BUDGET_STRIKES)
+		return;
+
+	rtems_stats_budget_strikes = 0;
+	switch (rtems_stats_current_mode) {
+		case RTEMS_STATS_MODE_TRACE:
+			errlogPrintf("rtemsStats: overhead at %.2f%% (budget %.2f%%). Switching from %s to %s\n",
+				     rtems_stats_overhead, rtems_stats_budget,
+				     rtems_stats_mode_names[RTEMS_STATS_MODE_TRACE],
+				     rtems_stats_mode_names[RTEMS_STATS_MODE_AGGREGATE]);
+			rtems_stats_current_mode = RTEMS_STATS_MODE_AGGREGATE;
+			// No more ISR events either: they're raw tracing too
+			rtems_stats_tracing = 0;
+			break;
+		case RTEMS_STATS_MODE_AGGREGATE:
+			errlogPrintf("rtemsStats: overhead at %.2f%% (budget %.2f%%). Switching from %s to %s\n",
+				     rtems_stats_overhead, rtems_stats_budget,
+				     rtems_stats_mode_names[RTEMS_STATS_MODE_AGGREGATE],
+				     rtems_stats_mode_names[RTEMS_STATS_MODE_OFF]);
+			rtems_stats_disable();
+			break;
+		default:
+			break;
+	}
+}
+
+// Lives for as long as the IOC, so that the overhead is known even if nobody reads the exports
+static void rtems_stats_budget_task(void *unused) {
+	for (;;) {
+		epicsThreadSleep(RTEMS_STATS_BUDGET_PERIOD);
+		if (rtems_stats_current_mode != RTEMS_STATS_MODE_OFF)
+			rtems_stats_check_budget();
+	}
+}
+
+static void rtems_stats_start_budget_task(void *unused) {
+	if (epicsThreadCreate("rtemsStatsBudget", epicsThreadPriorityLow,
+			      epicsThreadGetStackSize(epicsThreadStackSmall),
+			      rtems_stats_budget_task, NULL) == NULL)
+		errlogMessage("rtemsStats: can't create the budget task. The overhead won't be measured\n");
+}
+
+static void rtems_stats_info(void) {
+	printf("Mode:     %s\n", rtems_stats_mode_names[rtems_stats_current_mode]);
+	printf("Overhead: %.2f%% of CPU\n", rtems_stats_overhead);
+	if (rtems_stats_budget > 0.0)
+		printf("Budget:   %.2f%% of CPU\n", rtems_stats_budget);
+	else
+		printf("Budget:   none\n");
+}
+
+/*
+ * Interrupt accounting
+ *
+ * Handlers installed through the generic BSP interrupt layer can be wrapped
+ * (see rtemsStatsIsrWrap) so that the time spent in them is not silently
+ * charged to the interrupted task. Every wrapped handler gets its own slot
+ * with a hit counter and the accumulated/worst service time, which are kept
+ * at all times. When rtemsStats is tracing, ISR_ENTER/ISR_EXIT events are
+ * also recorded in a ring buffer of their own, so that a burst of interrupts
+ * cannot push the context switches out of the task ring buffer.
+ *
+ * ISR events reuse the task event layout: obj_id holds the vector number and
+ * wait_id the task that was interrupted. For ISR_EXIT, state holds the time
+ * spent in the handler, in nanoseconds, so that it can be charged back to the
+ * interrupted task regardless of the timestamp resolution.
+ */
+
+#define MAX_ISR_SLOTS  32
+#define MAX_ISR_EVENTS 512
+
+typedef struct {
+	struct timespec stamp;
+	unsigned ticks;
+	unsigned num_events;
+	unsigned head;
+	RTEMS_STATS_EVENT events[MAX_ISR_EVENTS];
+} rtems_stats_isr_ring_buffer;
+
+static rtems_stats_isr_ring_buffer isr_rb[2];
+static rtems_stats_isr_ring_buffer *isr_rb_active = &isr_rb[0];
+static rtems_stats_isr_ring_buffer *isr_rb_export = &isr_rb[1];
+
+#define INCR_ISR_RB_POINTER(x) (x = (x + 1) % MAX_ISR_EVENTS)
+
+#if defined(WITH_ISR_STATS)
+typedef struct {
+	rtems_vector_number vector;
+	rtems_interrupt_handler handler;
+	void *arg;
+	uint32_t count;
+	uint64_t busy_ns;
+	uint32_t max_ns;
+} rtems_stats_isr_slot;
+
+static rtems_stats_isr_slot isr_slots[MAX_ISR_SLOTS];
+static unsigned isr_num_slots = 0;
+
+static void rtems_stats_add_isr_event(rtems_stats_event_type type, rtems_vector_number vector, uint32_t elapsed) {
 	RTEMS_STATS_EVENT evt = {
-		.misc = EVENT_SET_MISC(EXIT, task->current_priority, task->real_priority),
-		.obj_id = task->Object.id
+		.misc    = EVENT_SET_MISC(type, 0, 0),
+		.state   = elapsed,
+		.obj_id  = vector,
+		.wait_id = _Thread_Executing ? _Thread_Executing->Object.id : 0
 	};
+	rtems_interrupt_level level;
+	unsigned index;
+
+	rtems_stats_stamp_event(&evt);
+
+	// Interrupts may nest: reserve the slot with interrupts off
+	rtems_interrupt_disable(level);
+	index = isr_rb_active->num_events % MAX_ISR_EVENTS;
+	isr_rb_active->num_events++;
+	if (index == isr_rb_active->head)
+		INCR_ISR_RB_POINTER(isr_rb_active->head);
+	memcpy(&isr_rb_active->events[index], &evt, sizeof(RTEMS_STATS_EVENT));
+	rtems_interrupt_enable(level);
+}
+
+static void rtems_stats_isr_wrapper(void *arg) {
+	rtems_stats_isr_slot *slot = (rtems_stats_isr_slot *)arg;
+	int tracing = rtems_stats_tracing;
+	uint64_t enter = rtems_stats_uptime_ns();
+	uint64_t start;
+	uint32_t elapsed;
+
+	if (tracing)
+		rtems_stats_add_isr_event(ISR_ENTER, slot->vector, 0);
+
+	start = rtems_stats_uptime_ns();
+	slot->handler(slot->arg);
+	elapsed = (uint32_t)(rtems_stats_uptime_ns() - start);
+
+	slot->count++;
+	slot->busy_ns += elapsed;
+	if (elapsed > slot->max_ns)
+		slot->max_ns = elapsed;
+
+	if (tracing)
+		rtems_stats_add_isr_event(ISR_EXIT, slot->vector, elapsed);
+
+	// Everything but the handler itself is our own overhead
+	rtems_stats_charge(&rtems_stats_isr_ns, rtems_stats_uptime_ns() - enter - elapsed);
+}
+
+typedef struct {
+	unsigned num_found;
+	rtems_option options[MAX_ISR_SLOTS];
+	rtems_interrupt_handler handlers[MAX_ISR_SLOTS];
+	void *args[MAX_ISR_SLOTS];
+	const char *info[MAX_ISR_SLOTS];
+} rtems_stats_isr_found;
+
+static void rtems_stats_isr_collect(void *arg, const char *info, rtems_option options,
+				    rtems_interrupt_handler handler, void *handler_arg) {
+	rtems_stats_isr_found *found = (rtems_stats_isr_found *)arg;
+
+	if ((handler == rtems_stats_isr_wrapper) || (found->num_found >= MAX_ISR_SLOTS))
+		return;
+
+	found->options[found->num_found]  = options;
+	found->handlers[found->num_found] = handler;
+	found->args[found->num_found]     = handler_arg;
+	found->info[found->num_found]     = info;
+	found->num_found++;
+}
+
+/*
+ * Replaces every handler installed on a vector with rtems_stats_isr_wrapper.
+ * The original handler is removed before the wrapper goes in, to keep unique
+ * vectors happy, which means that an interrupt arriving in between is lost.
+ * Do this at boot time, or on a quiet vector.
+ */
+static void rtems_stats_isr_wrap(rtems_vector_number vector) {
+	rtems_stats_isr_found found;
+	rtems_status_code ret;
+	unsigned i;
+
+	found.num_found = 0;
+	ret = rtems_interrupt_handler_iterate(vector, rtems_stats_isr_collect, &found);
+	if (ret != RTEMS_SUCCESSFUL) {
+		errlogPrintf("rtemsStats: can't inspect the handlers for vector %u (%d)\n", (unsigned)vector, ret);
+		return;
+	}
+
+	if (found.num_found == 0) {
+		errlogPrintf("rtemsStats: no unwrapped handlers installed on vector %u\n", (unsigned)vector);
+		return;
+	}
 
-	SET_ACTIVE_TASK(rb_active, task->Object.id);
-	rtems_stats_add_event(&evt);
+	for (i = 0; i < found.num_found; i++) {
+		rtems_stats_isr_slot *slot;
+
+		if (isr_num_slots >= MAX_ISR_SLOTS) {
+			errlogPrintf("rtemsStats: out of ISR slots (max %d)\n", MAX_ISR_SLOTS);
+			return;
+		}
+
+		slot = &isr_slots[isr_num_slots];
+		memset(slot, 0, sizeof(rtems_stats_isr_slot));
+		slot->vector  = vector;
+		slot->handler = found.handlers[i];
+		slot->arg     = found.args[i];
+
+		if (rtems_interrupt_handler_remove(vector, slot->handler, slot->arg) != RTEMS_SUCCESSFUL) {
+			errlogPrintf("rtemsStats: can't remove handler %p on vector %u\n", (void *)slot->handler, (unsigned)vector);
+			continue;
+		}
+
+		ret = rtems_interrupt_handler_install(vector, found.info[i], found.options[i],
+						      rtems_stats_isr_wrapper, slot);
+		if (ret != RTEMS_SUCCESSFUL) {
+			errlogPrintf("rtemsStats: can't wrap handler %p on vector %u (%d). Restoring it\n",
+				     (void *)slot->handler, (unsigned)vector, ret);
+			rtems_interrupt_handler_install(vector, found.info[i], found.options[i],
+							slot->handler, slot->arg);
+			continue;
+		}
+
+		isr_num_slots++;
+	}
+}
+
+static void rtems_stats_isr_show(void) {
+	unsigned i;
+
+	if (isr_num_slots == 0) {
+		printf("No interrupt handlers are being accounted\n");
+		return;
+	}
+
+	printf("Vector   Handler         Count    Busy (us)  Max (us)\n");
+	for (i = 0; i < isr_num_slots; i++) {
+		rtems_stats_isr_slot *slot = &isr_slots[i];
+
+		printf("%6u   %-12p %8lu %12llu %9lu\n", (unsigned)slot->vector, (void *)slot->handler,
+		       (unsigned long)slot->count, (unsigned long long)(slot->busy_ns / 1000),
+		       (unsigned long)(slot->max_ns / 1000));
+	}
+}
+#else
+static void rtems_stats_isr_wrap(unsigned vector) {
+	errlogMessage("rtemsStats was built without interrupt accounting (WITH_ISR_STATS)\n");
+}
+
+static void rtems_stats_isr_show(void) {
+	errlogMessage("rtemsStats was built without interrupt accounting (WITH_ISR_STATS)\n");
+}
+#endif
+
+static void rtems_stats_reset_isr_rb(rtems_stats_isr_ring_buffer *local_rb) {
+	epicsTimeStamp now;
+
+	memset(local_rb, 0, sizeof(rtems_stats_isr_ring_buffer));
+
+	if (epicsTimeGetCurrent(&now) == epicsTimeOK) {
+		local_rb->ticks = rtems_clock_get_ticks_since_boot();
+		epicsTimeToTimespecInt(&local_rb->stamp, &now);
+	}
+}
+
+// Returns the ISR ring buffer that was being filled up to this moment
+static rtems_stats_isr_ring_buffer *rtems_stats_switch_isr_rb(void) {
+	rtems_stats_isr_ring_buffer *next = isr_rb_export;
+	rtems_interrupt_level level;
+
+	rtems_stats_reset_isr_rb(next);
+	rtems_interrupt_disable(level);
+	isr_rb_export = isr_rb_active;
+	isr_rb_active = next;
+	rtems_interrupt_enable(level);
+
+	return isr_rb_export;
 }
 
 #define NUM_CHUNKS 6
@@ -476,6 +1059,9 @@ static void rtems_stats_export_init(aSubRecord *prec) {
  *   valj => array chunk #5
  *   valk => array chunk #6
  *   vall => array chunk #7
+ *   valn => overhead of the module, in hundredths of percent of CPU
+ *   valo => current mode (0: disabled, 1: aggregated counters, 2: raw tracing)
+ *   valp => array: number of activations for the captured tasks
  *   valr => array: IDs for the captured tasks
  *   vals => array: (known) names for the tasks
  *   valt => ticks at the beginning of the capture
@@ -489,6 +1075,7 @@ static long rtems_stats_export_support(aSubRecord *prec) {
 	unsigned total_longs = 0;
 	int i;
 	epicsUInt32 *nev;
+	uint64_t start = rtems_stats_uptime_ns();
 
 	*(epicsUInt32 *)prec->vala = rtems_clock_get_ticks_per_second();
 	*(unsigned long *)prec->valu = sizeinlongs;
@@ -499,6 +1086,7 @@ static long rtems_stats_export_support(aSubRecord *prec) {
 
 		if (export == NULL) {
 			errlogMessage("RTEMS STATS: Error trying to switch ring buffers");
+			rtems_stats_charge(&rtems_stats_export_ns, rtems_stats_uptime_ns() - start);
 			return 1;
 		}
 
@@ -520,6 +1108,7 @@ static long rtems_stats_export_support(aSubRecord *prec) {
 				for (j = 0; j < 32; j++) {
 					if ((1 << j) & export->ids[i]) {
 						((epicsUInt32 *)prec->valr)[nids] = tidbase + j;
+						((epicsUInt32 *)prec->valp)[nids] = export->activations[(i * 32) + j];
 						epicsThreadGetName((epicsThreadId)(tidbase + j), tname, MAX_STRING_SIZE);
 						if (strlen(tname) != 0)
 							strcpy(&((char *)prec->vals)[nids * MAX_STRING_SIZE], tname);
@@ -532,6 +1121,7 @@ static long rtems_stats_export_support(aSubRecord *prec) {
 		}
 
 		// TODO: It's unlikely that we have an only event, but if nids would be 1, this won't do...
+		prec->nevp = nids;
 		prec->nevr = nids;
 		prec->nevs = nids;
 	}
@@ -550,6 +1140,80 @@ static long rtems_stats_export_support(aSubRecord *prec) {
 		}
 	}
 
+	rtems_stats_charge(&rtems_stats_export_ns, rtems_stats_uptime_ns() - start);
+	*(epicsUInt32 *)prec->valn = (epicsUInt32)(rtems_stats_overhead * 100.0);
+	*(epicsUInt32 *)prec->valo = rtems_stats_current_mode;
+
+	return 0;
+}
+
+static void rtems_stats_isr_export_init(aSubRecord *prec) {
+	free(prec->valk);
+	free(prec->ovlk);
+
+	prec->valk = callocMustSucceed(MAX_ISR_EVENTS, sizeof(rtems_stats_event_with_timestamp), "rtems_stats_isr_export_init -> pval");
+	prec->ovlk = callocMustSucceed(MAX_ISR_EVENTS, sizeof(rtems_stats_event_with_timestamp), "rtems_stats_isr_export_init -> povl");
+}
+
+/*+
+ *   Function name:
+ *   rtems_stats_isr_export_support
+ *
+ *   Purpose:
+ *   Publishes the interrupt accounting. Counters are cumulative since the
+ *   handler was wrapped; events are the ones captured since the last call.
+ *
+ *   EPICS outputs:
+ *
+ *   vala => number of accounted handlers
+ *   valb => array: vector for each handler
+ *   valc => array: number of times each handler ran
+ *   vald => array: accumulated service time for each handler, in microseconds
+ *   vale => array: worst service time for each handler, in microseconds
+ *   valf => seconds at the beginning of the capture
+ *   valg => nanoseconds at the beginning of the capture
+ *   valh => ticks at the beginning of the capture
+ *   vali => number of events
+ *   valj => index of the first event
+ *   valk => array: ISR events
+ *   vall => ticks per second
+ *   valu => record size as multiple of LONG
+ */
+
+static long rtems_stats_isr_export_support(aSubRecord *prec) {
+	rtems_stats_isr_ring_buffer *export;
+	unsigned nslots = 0;
+	unsigned nevents;
+	uint64_t start = rtems_stats_uptime_ns();
+
+	*(unsigned long *)prec->valu = sizeinlongs;
+	*(epicsUInt32 *)prec->vall = rtems_clock_get_ticks_per_second();
+
+#if defined(WITH_ISR_STATS)
+	for (nslots = 0; nslots < isr_num_slots; nslots++) {
+		rtems_stats_isr_slot *slot = &isr_slots[nslots];
+
+		((epicsUInt32 *)prec->valb)[nslots] = slot->vector;
+		((epicsUInt32 *)prec->valc)[nslots] = slot->count;
+		((epicsUInt32 *)prec->vald)[nslots] = (epicsUInt32)(slot->busy_ns / 1000);
+		((epicsUInt32 *)prec->vale)[nslots] = slot->max_ns / 1000;
+	}
+#endif
+	*(epicsUInt32 *)prec->vala = nslots;
+	prec->nevb = prec->nevc = prec->nevd = prec->neve = nslots > 0 ? nslots : 1;
+
+	export = rtems_stats_switch_isr_rb();
+	nevents = export->num_events < MAX_ISR_EVENTS ? export->num_events : MAX_ISR_EVENTS;
+
+	memcpy(prec->valk, export->events, MAX_ISR_EVENTS * sizeof(RTEMS_STATS_EVENT));
+	*(epicsUInt32 *)prec->valf = export->stamp.tv_sec;
+	*(epicsUInt32 *)prec->valg = export->stamp.tv_nsec;
+	*(epicsUInt32 *)prec->valh = export->ticks;
+	*(epicsUInt32 *)prec->vali = export->num_events;
+	*(epicsUInt32 *)prec->valj = export->head;
+	prec->nevk = nevents > 0 ? nevents * sizeinlongs : 1;
+
+	rtems_stats_charge(&rtems_stats_export_ns, rtems_stats_uptime_ns() - start);
 	return 0;
 }
 
@@ -567,6 +1231,7 @@ enum rtems_stats_control_command {
 
 #define RTEMS_STATS_PRECISE_TIMING 0x01
 #define RTEMS_STATS_IS_ENABLED     0x02
+#define RTEMS_STATS_IS_AGGREGATING 0x04
 
 static long rtems_stats_control_support(aSubRecord *prec) {
 	char *cmds = (char*)prec->a;
@@ -598,9 +1263,12 @@ static long rtems_stats_control_support(aSubRecord *prec) {
 #if defined(WITH_INT_TIME)
 			*valc |= RTEMS_STATS_PRECISE_TIMING;
 #endif
-			if (rtems_stats_enabled() == RTEMS_SUCCESSFUL) {
+			if ((rtems_stats_enabled() == RTEMS_SUCCESSFUL) && !rtems_snapshot_busy) {
 				*valc |= RTEMS_STATS_IS_ENABLED;
 			}
+			if (rtems_stats_current_mode == RTEMS_STATS_MODE_AGGREGATE) {
+				*valc |= RTEMS_STATS_IS_AGGREGATING;
+			}
 			ret = 0;
 			break;
 		case ENABLE:
@@ -630,14 +1298,23 @@ static long rtems_stats_control_support(aSubRecord *prec) {
 }
 
 static const iocshArg rtemsStatsCountArg = {"count", iocshArgInt};
-static const iocshArg *const rtemsStatsSnapArgs[] = {&rtemsStatsCountArg};
-static const iocshFuncDef rtemsStatsSnapFuncDef = {"rtemsStatsSnap", 1, rtemsStatsSnapArgs};
+static const iocshArg rtemsStatsFileArg = {"file", iocshArgString};
+static const iocshArg *const rtemsStatsSnapArgs[] = {&rtemsStatsCountArg, &rtemsStatsFileArg};
+static const iocshFuncDef rtemsStatsSnapFuncDef = {"rtemsStatsSnap", 2, rtemsStatsSnapArgs};
 static const iocshFuncDef rtemsStatsEnableFuncDef = {"rtemsStatsEnable", 0, NULL};
 static const iocshFuncDef rtemsStatsDisableFuncDef = {"rtemsStatsDisable", 0, NULL};
+static const iocshFuncDef rtemsStatsInfoFuncDef = {"rtemsStatsInfo", 0, NULL};
+static const iocshArg rtemsStatsBudgetArg = {"percent", iocshArgDouble};
+static const iocshArg *const rtemsStatsSetBudgetArgs[] = {&rtemsStatsBudgetArg};
+static const iocshFuncDef rtemsStatsSetBudgetFuncDef = {"rtemsStatsSetBudget", 1, rtemsStatsSetBudgetArgs};
+static const iocshArg rtemsStatsVectorArg = {"vector", iocshArgInt};
+static const iocshArg *const rtemsStatsIsrWrapArgs[] = {&rtemsStatsVectorArg};
+static const iocshFuncDef rtemsStatsIsrWrapFuncDef = {"rtemsStatsIsrWrap", 1, rtemsStatsIsrWrapArgs};
+static const iocshFuncDef rtemsStatsIsrShowFuncDef = {"rtemsStatsIsrShow", 0, NULL};
 
 static void rtemsStatsSnapCallFunc(const iocshArgBuf *args)
 {
-	rtems_stats_snapshot(args[0].ival);
+	rtems_stats_snapshot(args[0].ival, args[1].sval);
 }
 
 static void rtemsStatsEnableCallFunc(const iocshArgBuf *args)
@@ -650,14 +1327,45 @@ static void rtemsStatsDisableCallFunc(const iocshArgBuf *args)
 	rtems_stats_disable();
 }
 
+static void rtemsStatsInfoCallFunc(const iocshArgBuf *args)
+{
+	rtems_stats_info();
+}
+
+static void rtemsStatsSetBudgetCallFunc(const iocshArgBuf *args)
+{
+	if (args[0].dval < 0.0 || args[0].dval > 100.0) {
+		errlogMessage("The overhead budget must be: 0 <= percent <= 100; with 0 = no budget\n");
+		return;
+	}
+	rtems_stats_budget = args[0].dval;
+	rtems_stats_budget_strikes = 0;
+}
+
+static void rtemsStatsIsrWrapCallFunc(const iocshArgBuf *args)
+{
+	rtems_stats_isr_wrap(args[0].ival);
+}
+
+static void rtemsStatsIsrShowCallFunc(const iocshArgBuf *args)
+{
+	rtems_stats_isr_show();
+}
+
 static void rtemsStatsRegister() {
 	iocshRegister(&rtemsStatsSnapFuncDef, rtemsStatsSnapCallFunc);
 	iocshRegister(&rtemsStatsEnableFuncDef, rtemsStatsEnableCallFunc);
 	iocshRegister(&rtemsStatsDisableFuncDef, rtemsStatsDisableCallFunc);
+	iocshRegister(&rtemsStatsInfoFuncDef, rtemsStatsInfoCallFunc);
+	iocshRegister(&rtemsStatsSetBudgetFuncDef, rtemsStatsSetBudgetCallFunc);
+	iocshRegister(&rtemsStatsIsrWrapFuncDef, rtemsStatsIsrWrapCallFunc);
+	iocshRegister(&rtemsStatsIsrShowFuncDef, rtemsStatsIsrShowCallFunc);
 }
 
 epicsExportRegistrar(rtemsStatsRegister);
 epicsRegisterFunction(rtems_stats_export_init);
 epicsRegisterFunction(rtems_stats_export_support);
+epicsRegisterFunction(rtems_stats_isr_export_init);
+epicsRegisterFunction(rtems_stats_isr_export_support);
 epicsRegisterFunction(rtems_stats_control_init);
 epicsRegisterFunction(rtems_stats_control_support);